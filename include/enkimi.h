@@ -43,6 +43,7 @@ typedef enum
 	enkiNBTTAG_List = 9,
 	enkiNBTTAG_Compound = 10,
 	enkiNBTTAG_Int_Array = 11,
+	enkiNBTTAG_Long_Array = 12,
 } enkiNBTTAG_ID;
 
 
@@ -98,6 +99,32 @@ int enkiNBTInitFromMemoryCompressed( enkiNBTDataStream* pStream_, uint8_t* pComp
 									    uint32_t compressedDataSize_, uint32_t uncompressedSizeHint_ );
 
 
+// Reusable output buffer and decompressor for inflating chunk streams.
+// The buffer only ever grows, so after the first few chunks decompression no longer allocates.
+// An arena is not thread safe, use one per thread.
+typedef struct enkiInflateArena_s
+{
+	uint8_t*           pBuffer;
+	size_t             capacity;
+	tinfl_decompressor decompressor;
+	// statistics, accumulated until cleared by the caller
+	uint64_t           compressedBytes;
+	uint64_t           uncompressedBytes;
+	uint32_t           streamCount;
+} enkiInflateArena;
+
+// enkiInflateArenaInit simply zeros data
+void enkiInflateArenaInit( enkiInflateArena* pArena_ );
+
+// Frees the arena buffer, any stream using it becomes invalid.
+void enkiInflateArenaFree( enkiInflateArena* pArena_ );
+
+// As enkiNBTInitFromMemoryCompressed, but streams the zlib data into the arena buffer, growing it in place.
+// The stream owns no allocation and is only valid until the arena is next used or freed.
+// returns 1 if successfull, 0 if not.
+int enkiNBTInitFromMemoryCompressedInArena( enkiNBTDataStream* pStream_, enkiInflateArena* pArena_,
+											uint8_t* pCompressedData_, uint32_t compressedDataSize_ );
+
 // returns 0 if no next tag, 1 if there was
 int enkiNBTReadNextTag( enkiNBTDataStream* pStream_ );
 
@@ -131,6 +158,7 @@ typedef struct enkiRegionFile_s
 {
 	uint8_t* pRegionData;
 	uint32_t regionDataSize;
+	uint8_t  isMapped; // pRegionData is a read only file mapping, not an allocation
 } enkiRegionFile;
 
 // enkiRegionFileInit simply zeros data
@@ -138,12 +166,42 @@ void enkiRegionFileInit( enkiRegionFile* pRegionFile_ );
 
 enkiRegionFile enkiRegionFileLoad( FILE* fp_ );
 
+// Maps the region file into memory instead of reading all of it.
+// Only the pages of the header and of the chunks which are accessed are read from disk,
+// and chunk streams decompress straight from the mapping, which is read only.
+// On failure pRegionData is NULL, which behaves as a region without chunks.
+// Free with enkiRegionFileFreeAllocations.
+enkiRegionFile enkiRegionFileMap( const char* pFilename_ );
+
+// Hints that the chunk will be accessed soon so its sectors can be read ahead.
+// Does nothing for regions loaded with enkiRegionFileLoad.
+void enkiPrefetchChunk( enkiRegionFile regionFile_, int32_t chunkNr_ );
+
 
 // 1 for a chunk exists, 0 for does not.
 uint8_t enkiHasChunk( enkiRegionFile regionFile_, int32_t chunkNr_ );
 
+// Compression of a chunk, the byte following the chunk length in the region file.
+typedef enum
+{
+	enkiChunkCompression_GZip = 1,
+	enkiChunkCompression_Zlib = 2,
+	enkiChunkCompression_None = 3,
+	enkiChunkCompression_LZ4 = 4,
+} enkiChunkCompression;
+
+// Initializes the stream with the chunk, decompressed according to its enkiChunkCompression.
+// Uncompressed chunks of a mapped region are copied, as enkiNBTReadChunk writes into the stream;
+// those of a loaded region are read in place.
+// The stream is cleared if the chunk does not exist or can not be decompressed.
 void enkiInitNBTDataStreamForChunk( enkiRegionFile regionFile_, int32_t chunkNr_, enkiNBTDataStream* pStream_ );
 
+// As enkiInitNBTDataStreamForChunk, but decompresses into pArena_ (see enkiNBTInitFromMemoryCompressedInArena).
+// Uncompressed chunks are never copied: the stream points into the region data, which may be a read only
+// mapping, so read it with enkiNBTScanChunk.
+void enkiInitNBTDataStreamForChunkInArena( enkiRegionFile regionFile_, int32_t chunkNr_, enkiNBTDataStream* pStream_,
+										   enkiInflateArena* pArena_ );
+
 int32_t enkiGetTimestampForChunk( enkiRegionFile regionFile_, int32_t chunkNr_ );
 
 // enkiFreeRegionFileData frees data allocated in enkiRegionFile
@@ -154,7 +212,10 @@ void enkiRegionFileFreeAllocations( enkiRegionFile* pRegionFile_ );
 // Note that both NULL gives 0.
 int enkiAreStringsEqual( const char* lhs_, const char* rhs_ );
 
-#define ENKI_MI_NUM_SECTIONS_PER_CHUNK 16
+// Sections from Y = ENKI_MI_MIN_SECTION_Y up are kept, blocks -64 to 319 as in Minecraft 1.18
+// onwards; older worlds only fill Y 0 to 15. sections[ i ] is the section at Y = i + ENKI_MI_MIN_SECTION_Y.
+#define ENKI_MI_MIN_SECTION_Y -4
+#define ENKI_MI_NUM_SECTIONS_PER_CHUNK 24
 #define ENKI_MI_SIZE_SECTIONS 16
 
 typedef struct enkiMICoordinate_s
@@ -164,12 +225,26 @@ typedef struct enkiMICoordinate_s
 	int32_t z;
 } enkiMICoordinate;
 
+// A section in the palette format of Minecraft 1.13 and later, pointing into the NBT data.
+// Each block is an index into the palette, packed in big endian longs.
+typedef struct enkiChunkSectionPalette_s
+{
+	const uint8_t* pBlockStates;   // NULL if every block is palette entry 0
+	int32_t        numBlockStates; // number of longs
+	const uint8_t* pPalette;       // first compound of the palette list, NULL if the section has none
+	const uint8_t* pPaletteEnd;    // end of the palette list
+	int32_t        paletteSize;
+} enkiChunkSectionPalette;
+
 typedef struct enkiChunkBlockData_s
 {
 	uint8_t* sections[ ENKI_MI_NUM_SECTIONS_PER_CHUNK ];
+	// sections in the palette format, only read by enkiNBTScanChunk. sections[] is NULL for these.
+	enkiChunkSectionPalette palettes[ ENKI_MI_NUM_SECTIONS_PER_CHUNK ];
 	int32_t xPos; // section coordinates
 	int32_t zPos; // section coordinates
 	int32_t countOfSections;
+	int32_t countOfDroppedSections; // sections with blocks outside the kept Y range
 } enkiChunkBlockData;
 
 // enkiChunkInit simply zeros data
@@ -180,10 +255,32 @@ void enkiChunkInit( enkiChunkBlockData* pChunk_ );
 // pStream_ mush be kept valid whilst chunk is in use.
 enkiChunkBlockData enkiNBTReadChunk( enkiNBTDataStream* pStream_ );
 
+// enkiNBTScanChunk gets the same chunk data as enkiNBTReadChunk, but faster.
+// Tag names are matched by precomputed hashes, and every subtree not on the path to
+// Level/xPos, Level/zPos and Level/Sections/{Y,Blocks} is skipped using its length prefixes.
+// The stream data and read position are not modified, so it also works on read only memory.
+// Returns an empty chunk if the data is malformed or truncated.
+// Sections in the palette format are returned in palettes[]: Level/Sections/{Palette,BlockStates}
+// for 1.13 to 1.17, and sections/block_states/{palette,data} at the root for 1.18 onwards.
+// Sections outside the Y range above are dropped and counted in countOfDroppedSections.
+enkiChunkBlockData enkiNBTScanChunk( const enkiNBTDataStream* pStream_ );
+
+// Gets the Name string of each palette entry of a section ("minecraft:stone").
+// Names point into the NBT data and are not NUL terminated.
+// Returns the number of entries, at most maxNames_, or -1 if the palette is malformed.
+int32_t enkiGetSectionPaletteNames( const enkiChunkSectionPalette* pPalette_, const char** ppNames_,
+									uint16_t* pNameLengths_, int32_t maxNames_ );
+
+// Unpacks the blocks of a palette section into 4096 bytes in YZX order, mapping each palette
+// index through pLookup_, which has paletteSize entries. Indices past the palette become 0.
+// Indices straddling longs (1.13 to 1.15) or not (1.16 onwards) are told apart by the array length.
+// Returns 0 if the block states do not match the palette size.
+int enkiUnpackBlockStates( const enkiChunkSectionPalette* pPalette_, const uint8_t* pLookup_, uint8_t* pBlocks_ );
+
 
 enkiMICoordinate enkiGetChunkOrigin( enkiChunkBlockData* pChunk_ );
 
-// get the origin of a section (0 <-> ENKI_MI_NUM_SECTIONS_PER_CHUNK).
+// get the origin of a section (0 <-> ENKI_MI_NUM_SECTIONS_PER_CHUNK), its y is negative below section Y 0.
 enkiMICoordinate enkiGetChunkSectionOrigin( enkiChunkBlockData* pChunk_, int32_t section_ );
 
 // sectionOffset_ is the position from enkiGetChunkSectionOrigin
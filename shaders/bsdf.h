@@ -13,7 +13,7 @@ float Sin2Theta(vec3 w){
     return max(0.0, 1 - Cos2Theta(w));
 }
 float SinTheta(vec3 w){
-    return sqrt(SinTheta(w));
+    return sqrt(Sin2Theta(w));
 }
 float Tan2Theta(vec3 w){
     return Sin2Theta(w) / Cos2Theta(w);
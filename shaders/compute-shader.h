@@ -1,9 +1,7 @@
 const char *computeShaderSource = R"(
 #line 1
 layout(local_size_x = 16, local_size_y = 16,local_size_z = 1) in;
-layout(binding = 0) uniform sampler3D world;
 layout(binding = 1, rgba32f)  uniform image2D accumlatedImage;
-layout(binding = 2, rgba32f)  uniform image2D seeds;
 layout(binding = 3, rgba32f)  writeonly uniform image2D composedImage;
 uniform vec2 iResolution;
 uniform mat4 cameraOrigin;
@@ -11,12 +9,23 @@ uniform mat4 cameraDirection;
 uniform ivec3 worldDimension;
 uniform int iTime;
 uniform vec3 sunPos;
+// LiBackground towards the sun, and by direction, see SkyLut
+uniform vec3 sunRadiance;
+uniform sampler2D skyView;
 uniform uint options;
 uniform int maxDepth;
 uniform float maxRayIntensity;
 uniform int octreeRoot;
+uniform ivec3 brickGridDimension;
+uniform uint dagRoot;
+uniform int dagLevels;
+uniform int tree64Levels;
+// per brick, Chebyshev distance in bricks to the nearest brick that is not
+// all air, see World::emptyDistance
+uniform usampler3D emptyDistance;
 
 #define ENABLE_ATMOSPHERE_SCATTERING 0x1
+#define USE_TREE64 0x2
 
 struct Material {
     vec3 emission;
@@ -34,17 +43,48 @@ layout(std430, binding = 4) readonly buffer Materials{
     float MaterialEmissionStrength[MATERIAL_COUNT];
 };
 
+// see OctreeNode in main.cpp: 16 bit bounds relative to the parent's pmin,
+// children stored contiguously from firstChild in child mask order
 struct OctreeNode {
-    ivec3 pmin;
-    ivec3 pmax;
-    int children[8];
-    bool isLeaf;
+    uint bounds[3];
+    uint info;
+    uint firstChild;
+    uint parent;
 };
+#define OCTREE_CHILD_MASK 0xffu
+#define OCTREE_LEAF 0x100u
+#define OCTREE_SLOT_SHIFT 9
 
 layout(std430, binding = 5) readonly buffer Octree{
     OctreeNode[] octree;
 };
 
+// sparse voxels, see BrickMap
+#define BRICK_WIDTH 8
+#define UNIFORM_BRICK 0x80000000u
+layout(std430, binding = 6) readonly buffer BrickGrid{
+    uint brickGrid[];
+};
+layout(std430, binding = 7) readonly buffer BrickPool{
+    uint brickPool[]; // 4 voxels per uint
+};
+// a bit per voxel of each pool brick, see World::occupancy
+#define OCCUPANCY_WORDS 16
+layout(std430, binding = 9) readonly buffer BrickOccupancy{
+    uint brickOccupancy[];
+};
+
+// see Tree64Node in main.cpp: 4x4x4 cells, x fastest, children of the
+// occupied cells stored contiguously from firstChild in bit order
+struct Tree64Node {
+    uint mask[2];
+    uint firstChild;
+};
+#define TREE64_MAX_LEVELS 8
+layout(std430, binding = 8) readonly buffer Tree64{
+    Tree64Node[] tree64;
+};
+
 
 
 float maxComp(vec3 o){
@@ -114,8 +154,81 @@ bool insideWorld(vec3 p){
 bool insideBox(vec3 p, ivec3 pmin, ivec3 pmax){
     return all(lessThanEqual(p, vec3(pmax) + vec3(1))) && all(greaterThanEqual(p, vec3(pmin) - vec3(1)));
 }
+#ifdef USE_DAG
+// sparse voxel DAG, see VoxelDag: the grid buffer holds its nodes, 8
+// references each, the pool its leaves of 2x2x2 voxels
+#define DAG_BRICK_LEVEL 2
+ivec3 lastBrick = ivec3(-1);
+uint lastBrickRef = UNIFORM_BRICK;
+int map(vec3 p){
+    ivec3 v = ivec3(p);
+    if(any(lessThan(v, ivec3(0))) || any(greaterThanEqual(v, worldDimension))){
+        return 0;
+    }
+    // consecutive DDA steps mostly stay in the same brick, only the levels
+    // inside it are descended again
+    ivec3 b = v >> 3;
+    uint ref = lastBrickRef;
+    if(any(notEqual(b, lastBrick))){
+        ref = dagRoot;
+        for(int level = dagLevels; level > DAG_BRICK_LEVEL && (ref & UNIFORM_BRICK) == 0u; level--){
+            ivec3 c = (v >> level) & 1;
+            ref = brickGrid[ref * 8u + uint(c.x + 2 * c.y + 4 * c.z)];
+        }
+        lastBrick = b;
+        lastBrickRef = ref;
+    }
+    for(int level = DAG_BRICK_LEVEL; level > 0 && (ref & UNIFORM_BRICK) == 0u; level--){
+        ivec3 c = (v >> level) & 1;
+        ref = brickGrid[ref * 8u + uint(c.x + 2 * c.y + 4 * c.z)];
+    }
+    if((ref & UNIFORM_BRICK) != 0u){
+        return int(ref & 0xffu);
+    }
+    ivec3 c = v & 1;
+    uint i = ref * 8u + uint(c.x + 2 * c.y + 4 * c.z);
+    return int((brickPool[i >> 2] >> ((i & 3u) * 8u)) & 0xffu);
+}
+#else
 int map(vec3 p){
-    return int(texelFetch(world, ivec3(p), 0).r * 255.0);
+    ivec3 v = ivec3(p);
+    if(any(lessThan(v, ivec3(0))) || any(greaterThanEqual(v, worldDimension))){
+        return 0;
+    }
+    ivec3 b = v / BRICK_WIDTH;
+    uint ref = brickGrid[b.x + brickGridDimension.x * (b.y + brickGridDimension.y * b.z)];
+    if((ref & UNIFORM_BRICK) != 0u){
+        return int(ref & 0xffu);
+    }
+    ivec3 l = v % BRICK_WIDTH;
+    uint i = ref * uint(BRICK_WIDTH * BRICK_WIDTH * BRICK_WIDTH) + uint(l.x + BRICK_WIDTH * (l.y + BRICK_WIDTH * l.z));
+    return int((brickPool[i >> 2] >> ((i & 3u) * 8u)) & 0xffu);
+}
+#endif
+// whether the voxel is not air, without reading the brick pool
+bool occupied(vec3 p){
+#ifdef USE_DAG
+    return map(p) != 0;
+#else
+    ivec3 v = ivec3(p);
+    if(any(lessThan(v, ivec3(0))) || any(greaterThanEqual(v, worldDimension))){
+        return false;
+    }
+    ivec3 b = v / BRICK_WIDTH;
+    uint ref = brickGrid[b.x + brickGridDimension.x * (b.y + brickGridDimension.y * b.z)];
+    if((ref & UNIFORM_BRICK) != 0u){
+        return (ref & 0xffu) != 0u;
+    }
+    ivec3 l = v % BRICK_WIDTH;
+    uint i = uint(l.x + BRICK_WIDTH * (l.y + BRICK_WIDTH * l.z));
+    return ((brickOccupancy[ref * uint(OCCUPANCY_WORDS) + (i >> 5)] >> (i & 31u)) & 1u) != 0u;
+#endif
+}
+void setMaterial(inout Intersection isct, int mat){
+    isct.mat.baseColor = MaterialBaseColor[mat].rgb;
+    isct.mat.emission = MaterialEmission[mat].rgb *  MaterialEmissionStrength[mat];
+    isct.mat.roughness = MaterialRoughness[mat] * MaterialRoughness[mat];
+    isct.mat.metallic = MaterialMetallic[mat];
 }
 #define USE_BRANCHLESS_DDA
 const float tFar = 500.0f;
@@ -139,23 +252,46 @@ bool intersect1(vec3 ro, vec3 rd, ivec3 pmin, ivec3 pmax, inout Intersection isc
 	vec3 mask = vec3(0, 0, 0);
 	float t = 0;
     int maxIter = int(dot(pmax - pmin, ivec3(1)));
+    ivec3 skippedBrick = ivec3(-1);
 	for (int i = 0; i < maxIter; ++i) {
         // if(distance + t > isct.t + 1.0)break;
 		if (!insideBox(p,pmin - ivec3(1), pmax + ivec3(1))) {
 			break;
 		}
-		int mat = map(p);
+		bool occ = occupied(p);
 
-		if (mat > 0 && t >= RayBias) {
+		if (occ && t >= RayBias) {
 			isct.p = p0 + rd* t;
 			isct.t = distance + t;
 			isct.n = -sign(rd) * mask;
-            isct.mat.baseColor = MaterialBaseColor[mat].rgb;
-            isct.mat.emission = MaterialEmission[mat].rgb *  MaterialEmissionStrength[mat];
-            isct.mat.roughness = MaterialRoughness[mat] * MaterialRoughness[mat];
-            isct.mat.metallic = MaterialMetallic[mat];
+            setMaterial(isct, map(p));
 			return true;
 		}
+        // the bricks less than d bricks away are all air: jump to where the
+        // ray leaves their cube. A brick is skipped from once, should the
+        // jump land back in it the DDA steps out.
+        ivec3 b = ivec3(p) >> 3;
+        if (!occ && any(notEqual(b, skippedBrick)) && all(greaterThanEqual(p, vec3(0))) &&
+            all(lessThan(b, brickGridDimension))) {
+            int d = int(texelFetch(emptyDistance, b, 0).r);
+            if (d > 0) {
+                skippedBrick = b;
+                vec3 lo = vec3((b - ivec3(d - 1)) * BRICK_WIDTH);
+                vec3 hi = vec3((b + ivec3(d)) * BRICK_WIDTH);
+                vec3 exit = (mix(lo, hi, greaterThan(rd, vec3(0))) - p0) * invd;
+                exit = mix(exit, vec3(1e10), equal(rd, vec3(0)));
+                float tExit = minComp(exit);
+                if (tExit > t) {
+                    t = tExit;
+                    mask = step(exit, vec3(tExit));
+                    mask = mask.x > 0.0 ? vec3(1, 0, 0) : mask.y > 0.0 ? vec3(0, 1, 0) : vec3(0, 0, 1);
+                    // the voxel past the face of the cube the ray leaves by
+                    p = mix(floor(p0 + rd * t), mix(lo - vec3(1), hi, greaterThan(rd, vec3(0))), mask);
+                    tMax = abs((p + max(stp, vec3(0,0,0)) - p0) * invd);
+                    continue;
+                }
+            }
+        }
 #ifdef USE_BRANCHLESS_DDA
         mask = step(tMax.xyz, tMax.yxy) * step(tMax.xyz, tMax.zzx);
         p += stp * mask;
@@ -194,109 +330,241 @@ bool intersect1(vec3 ro, vec3 rd, ivec3 pmin, ivec3 pmax, inout Intersection isc
 	}
     return false;
 }
-#define OCTREE_FOR(_x,_y,_z)\
-    for(int dx = 0; dx < 2;dx++){for(int dy = 0; dy < 2;dy++){for(int dz = 0; dz < 2;dz++){\
-        int x = _x;int y = _y; int z = _z;int i = 4 * z + 2 * y + x;\
-        if(node.children[i] >= 0){stack[sp++] = node.children[i];}}}}
-
-bool occlude(vec3 ro, vec3 rd){
-    int stack[64];
-    int sp = 1;
-    stack[0] = octreeRoot;
-    while(sp > 0){
-        OctreeNode node = octree[stack[--sp]];
-        ivec3 pmin = node.pmin - ivec3(1);
-        ivec3 pmax = node.pmax + ivec3(1);
-        
-        float t = intersectBox(ro, rd, vec3(pmin), vec3(pmax));
-        if(t < 0.0){
-            continue;
+// Any-hit test of a leaf box for shadow rays, on voxel occupancy only: a two
+// level DDA that crosses the cubes of empty bricks around an air brick (see
+// emptyDistance) in one step and the other bricks voxel by voxel. As in
+// intersect1, the voxel the ray enters the box by is never a hit.
+bool occludeLeaf(vec3 ro, vec3 rd, ivec3 pmin, ivec3 pmax){
+    float tStart = intersectBox(ro, rd, vec3(pmin), vec3(pmax));
+    if(tStart < 0.0){
+        return false;
+    }
+#ifdef USE_DAG
+    Intersection tmp;
+    tmp.t = 1e8;
+    return intersect1(ro, rd, pmin, pmax, tmp);
+#else
+    vec3 invd = clamp(vec3(1) / rd, vec3(-1e10), vec3(1e10));
+    bvec3 positive = greaterThan(rd, vec3(0));
+    float t = tStart;
+    ivec3 v = clamp(ivec3(floor(ro + rd * t)), pmin, pmax - ivec3(1));
+    int maxIter = int(dot(pmax - pmin, ivec3(1)));
+    for(int i = 0; i < maxIter; i++){
+        ivec3 b = v >> 3;
+        vec3 lo = vec3(v);
+        vec3 hi = lo + vec3(1);
+        if(all(greaterThanEqual(b, ivec3(0))) && all(lessThan(b, brickGridDimension))){
+            uint ref = brickGrid[b.x + brickGridDimension.x * (b.y + brickGridDimension.y * b.z)];
+            bool occ;
+            if(ref == UNIFORM_BRICK){
+                int d = int(texelFetch(emptyDistance, b, 0).r);
+                lo = vec3((b - ivec3(d - 1)) * BRICK_WIDTH);
+                hi = vec3((b + ivec3(d)) * BRICK_WIDTH);
+                occ = false;
+            } else if((ref & UNIFORM_BRICK) != 0u){
+                occ = true;
+            } else {
+                ivec3 l = v % BRICK_WIDTH;
+                uint j = uint(l.x + BRICK_WIDTH * (l.y + BRICK_WIDTH * l.z));
+                occ = ((brickOccupancy[ref * uint(OCCUPANCY_WORDS) + (j >> 5)] >> (j & 31u)) & 1u) != 0u;
+            }
+            if(occ && t - tStart >= RayBias && all(lessThan(v, worldDimension))){
+                return true;
+            }
+        }
+        vec3 exit = (mix(lo, hi, positive) - ro) * invd;
+        exit = mix(exit, vec3(1e10), equal(rd, vec3(0)));
+        float tExit = minComp(exit);
+        vec3 mask = exit.x <= min(exit.y, exit.z) ? vec3(1, 0, 0) : exit.y <= exit.z ? vec3(0, 1, 0) : vec3(0, 0, 1);
+        t = max(t, tExit);
+        // the voxel past the face the ray leaves the cell by
+        vec3 q = clamp(floor(ro + rd * t), lo, hi - vec3(1));
+        v = ivec3(mix(q, mix(lo - vec3(1), hi, positive), mask));
+        if(any(lessThan(v, pmin)) || any(greaterThanEqual(v, pmax))){
+            return false;
         }
-        if(node.isLeaf){
-            Intersection tmp;
-            tmp.t = 1e8;
-            bool _hit = intersect1(ro, rd, pmin, pmax, tmp);
-            if(_hit){
-               return true;
+    }
+    return false;
+#endif
+}
+// Front to back traversal of the 64-tree: the cell the ray is in is looked
+// up in the node of each level down from the lowest one containing it. An
+// occupied cell is descended into, an empty one stepped over to the face the
+// ray leaves it by. The first voxel reached is the closest hit, its material
+// is not looked up for anyHit.
+bool intersectTree64(vec3 ro, vec3 rd, bool anyHit, inout Intersection isct){
+    float size = float(1 << (2 * tree64Levels));
+    vec3 invd = clamp(vec3(1) / rd, vec3(-1e10), vec3(1e10));
+    vec3 t0 = -ro * invd;
+    vec3 t1 = (vec3(size) - ro) * invd;
+    vec3 tmin = min(t0, t1);
+    float t = maxComp(tmin);
+    if(t >= minComp(max(t0, t1)) || minComp(max(t0, t1)) < 0.0){
+        return false;
+    }
+    vec3 mask = tmin.x >= max(tmin.y, tmin.z) ? vec3(1, 0, 0) : tmin.y >= tmin.z ? vec3(0, 1, 0) : vec3(0, 0, 1);
+    t = max(t, 0.0);
+    ivec3 v = ivec3(clamp(floor(ro + rd * t), vec3(0), vec3(size - 1.0)));
+    uint stack[TREE64_MAX_LEVELS + 1];
+    int level = tree64Levels;
+    stack[level] = 0u;
+    int maxIter = 12 * int(size);
+    for(int i = 0; i < maxIter && t < isct.t; i++){
+        Tree64Node node = tree64[stack[level]];
+        int shift = 2 * (level - 1);
+        ivec3 c = (v >> shift) & 3;
+        int bit = c.x + 4 * c.y + 16 * c.z;
+        uint below = (1u << (bit & 31)) - 1u;
+        if((node.mask[bit >> 5] & (1u << (bit & 31))) != 0u){
+            if(level > 1){
+                int skipped = bit < 32 ? bitCount(node.mask[0] & below)
+                                       : bitCount(node.mask[0]) + bitCount(node.mask[1] & below);
+                level--;
+                stack[level] = node.firstChild + uint(skipped);
+                continue;
             }
-        } else {
-            bvec3 mask = lessThan(rd, vec3(0));
-            bvec2 tf = bvec2(true, false);
-            // if rd.x < 0, then push left first
-            if(all(equal(mask, tf.xxx))){
-                OCTREE_FOR(dx,dy,dz);
-            }else if(all(equal(mask, tf.yxx))){
-                OCTREE_FOR(1-dx,dy,dz);
-            }else if(all(equal(mask, tf.xyx))){
-                OCTREE_FOR(dx,1-dy,dz);
-            }else if(all(equal(mask, tf.yyx))){
-                OCTREE_FOR(1-dx,1-dy,dz);
-            }else if(all(equal(mask, tf.xxy))){
-                OCTREE_FOR(dx,dy,1-dz);
-            }else if(all(equal(mask, tf.yxy))){
-                OCTREE_FOR(1-dx,dy,1-dz);
-            }else if(all(equal(mask, tf.xyy))){
-                OCTREE_FOR(dx,1-dy,1-dz);
-            }else /*if(all(equal(mask, tf.yyy)))*/{
-                OCTREE_FOR(1-dx,1-dy,1-dz);
+            // the voxel the ray starts in is not a hit, as in intersect1
+            if(t >= RayBias){
+                if(anyHit){
+                    return true;
+                }
+                isct.t = t;
+                isct.p = ro + rd * t;
+                isct.n = -sign(rd) * mask;
+                setMaterial(isct, map(vec3(v)));
+                return true;
             }
         }
+        vec3 cellMin = vec3((v >> shift) << shift);
+        vec3 cellMax = cellMin + float(1 << shift);
+        vec3 exit = (mix(cellMin, cellMax, greaterThan(rd, vec3(0))) - ro) * invd;
+        exit = mix(exit, vec3(1e10), equal(rd, vec3(0)));
+        float tExit = minComp(exit);
+        mask = exit.x <= min(exit.y, exit.z) ? vec3(1, 0, 0) : exit.y <= exit.z ? vec3(0, 1, 0) : vec3(0, 0, 1);
+        t = max(t, tExit);
+        // the voxel past the face the ray leaves by, the other axes kept
+        // inside the cell
+        vec3 q = clamp(floor(ro + rd * t), cellMin, cellMax - vec3(1));
+        q = mix(q, mix(cellMin - vec3(1), cellMax, greaterThan(rd, vec3(0))), mask);
+        if(any(lessThan(q, vec3(0))) || any(greaterThanEqual(q, vec3(size)))){
+            return false;
+        }
+        ivec3 next = ivec3(q);
+        // up to the lowest node containing both voxels
+        ivec3 diff = v ^ next;
+        level = max(level, findMSB(diff.x | diff.y | diff.z) / 2 + 1);
+        v = next;
     }
     return false;
 }
+void decodeNode(OctreeNode node, ivec3 parentMin, out ivec3 pmin, out ivec3 pmax){
+    pmin = parentMin + ivec3(node.bounds[0] & 0xffffu, node.bounds[0] >> 16, node.bounds[1] & 0xffffu);
+    pmax = parentMin + ivec3(node.bounds[1] >> 16, node.bounds[2] & 0xffffu, node.bounds[2] >> 16);
+}
 
-bool intersect2(vec3 ro, vec3 rd, inout Intersection isct){
+// Child mask reordered for the ray: bit k is that of slot k ^ octant, where
+// octant has a bit per negative direction component. Children are visited in
+// increasing k, nearest first.
+uint rayOrder(uint childMask, uint octant){
+    if((octant & 1u) != 0u){
+        childMask = (childMask & 0x55u) << 1 | ((childMask >> 1) & 0x55u);
+    }
+    if((octant & 2u) != 0u){
+        childMask = (childMask & 0x33u) << 2 | ((childMask >> 2) & 0x33u);
+    }
+    if((octant & 4u) != 0u){
+        childMask = (childMask & 0x0fu) << 4 | ((childMask >> 4) & 0x0fu);
+    }
+    return childMask;
+}
+
+// Octree traversal without a stack. Once a node is done the next sibling in
+// ray order comes from the parent's child mask, climbing up the parent links
+// while there is none. Bounds are relative to the parent's pmin, which is
+// recovered on the way up from the offset of the node being left. Returns at
+// the first hit when anyHit is set.
+bool traverseOctree(vec3 ro, vec3 rd, bool anyHit, inout Intersection isct){
+    if(octreeRoot < 0){
+        return false;
+    }
     bool hit = false;
-    int stack[64];
-    int sp = 1;
-    stack[0] = octreeRoot;
-    while(sp > 0){
-        OctreeNode node = octree[stack[--sp]];
-        ivec3 pmin = node.pmin - ivec3(1);
-        ivec3 pmax = node.pmax + ivec3(1);
-        
+    uint octant = uint(rd.x < 0.0) | uint(rd.y < 0.0) << 1 | uint(rd.z < 0.0) << 2;
+    uint root = uint(octreeRoot);
+    uint current = root;
+    OctreeNode node = octree[current];
+    OctreeNode parent = node; // of current, unused at the root
+    ivec3 parentMin = ivec3(0);
+    for(;;){
+        ivec3 nodeMin, nodeMax;
+        decodeNode(node, parentMin, nodeMin, nodeMax);
+        ivec3 pmin = nodeMin - ivec3(1);
+        ivec3 pmax = nodeMax + ivec3(1);
         float t = intersectBox(ro, rd, vec3(pmin), vec3(pmax));
-        if(t < 0.0 || t > isct.t){
-            continue;
+        if(t >= 0.0 && t <= isct.t){
+            if((node.info & OCTREE_LEAF) != 0u){
+                if(anyHit){
+                    if(occludeLeaf(ro, rd, pmin, pmax)){
+                        return true;
+                    }
+                } else {
+                    Intersection tmp;
+                    tmp.t = isct.t;
+                    if(intersect1(ro, rd, pmin, pmax, tmp) && tmp.t < isct.t){
+                        isct = tmp;
+                        hit = true;
+                    }
+                }
+            } else {
+                uint childMask = node.info & OCTREE_CHILD_MASK;
+                uint slot = uint(findLSB(rayOrder(childMask, octant))) ^ octant;
+                parent = node;
+                parentMin = nodeMin;
+                current = node.firstChild + uint(bitCount(childMask & ((1u << slot) - 1u)));
+                node = octree[current];
+                continue;
+            }
         }
-        // return true;
-        if(node.isLeaf){
-            Intersection tmp;
-            tmp.t = isct.t;
-            bool _hit = intersect1(ro, rd, pmin, pmax, tmp);
-            if(_hit && tmp.t < isct.t){
-                isct = tmp;
-                hit = true;
+        for(;;){
+            if(current == root){
+                return hit;
+            }
+            uint childMask = parent.info & OCTREE_CHILD_MASK;
+            uint k = ((node.info >> OCTREE_SLOT_SHIFT) & 7u) ^ octant;
+            uint later = rayOrder(childMask, octant) & (0xfeu << k);
+            if(later != 0u){
+                uint slot = uint(findLSB(later)) ^ octant;
+                current = parent.firstChild + uint(bitCount(childMask & ((1u << slot) - 1u)));
+                node = octree[current];
+                break;
             }
-        } else {
-
-
-            bvec3 mask = lessThan(rd, vec3(0));
-            bvec2 tf = bvec2(true, false);
-            // if rd.x < 0, then push left first
-            if(all(equal(mask, tf.xxx))){
-                OCTREE_FOR(dx,dy,dz);
-            }else if(all(equal(mask, tf.yxx))){
-                OCTREE_FOR(1-dx,dy,dz);
-            }else if(all(equal(mask, tf.xyx))){
-                OCTREE_FOR(dx,1-dy,dz);
-            }else if(all(equal(mask, tf.yyx))){
-                OCTREE_FOR(1-dx,1-dy,dz);
-            }else if(all(equal(mask, tf.xxy))){
-                OCTREE_FOR(dx,dy,1-dz);
-            }else if(all(equal(mask, tf.yxy))){
-                OCTREE_FOR(1-dx,dy,1-dz);
-            }else if(all(equal(mask, tf.xyy))){
-                OCTREE_FOR(dx,1-dy,1-dz);
-            }else /*if(all(equal(mask, tf.yyy)))*/{
-                OCTREE_FOR(1-dx,1-dy,1-dz);
+            current = node.parent;
+            node = parent;
+            // parentMin was the pmin of node, now that of its parent
+            parentMin -= ivec3(node.bounds[0] & 0xffffu, node.bounds[0] >> 16, node.bounds[1] & 0xffffu);
+            if(current != root){
+                parent = octree[node.parent];
             }
-            
         }
     }
     return hit;
 }
 
+bool occlude(vec3 ro, vec3 rd){
+    Intersection tmp;
+    tmp.t = 1e8;
+    if(0 != (options & USE_TREE64)){
+        return intersectTree64(ro, rd, true, tmp);
+    }
+    return traverseOctree(ro, rd, true, tmp);
+}
+
+bool intersect2(vec3 ro, vec3 rd, inout Intersection isct){
+    if(0 != (options & USE_TREE64)){
+        return intersectTree64(ro, rd, false, isct);
+    }
+    return traverseOctree(ro, rd, false, isct);
+}
+
 #define NO_PLANE
 bool intersect(vec3 ro, vec3 rd, out Intersection isct){
     isct.t = 1e8;
@@ -335,19 +603,66 @@ vec2 random2(vec3 st){
   return fract(sin(S)*43758.5453123);
 }
 
+// Owen-scrambled Sobol points (Burley, Practical Hash-based Owen
+// Scrambling). Each nextFloat2 draws the 2D Sobol point of the sample index,
+// with the index shuffled and both coordinates scrambled by a hash of the
+// pixel and dimension, so nothing is stored between passes.
 struct Sampler{
     int dimension;
-    uint seed;
+    uint index; // iTime
+    uint seed;  // hash of the pixel
 };
 
-float nextFloat(inout Sampler sampler){
-    sampler.seed = (1103515245*(sampler.seed) + 12345);
-    sampler.dimension++;
-    return float(sampler.seed) * 2.3283064370807974e-10;
+uint hashUint(uint x){
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+uint laineKarrasPermutation(uint x, uint seed){
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+uint nestedUniformScramble(uint x, uint seed){
+    return bitfieldReverse(laineKarrasPermutation(bitfieldReverse(x), seed));
+}
+// the first two Sobol dimensions, as 32 bit fractions
+uvec2 sobol2(uint index){
+    uint x = bitfieldReverse(index);
+    uint y = 0u;
+    for(uint v = 1u << 31; index != 0u; index >>= 1, v ^= v >> 1){
+        if((index & 1u) != 0u)
+            y ^= v;
+    }
+    return uvec2(x, y);
+}
+
+Sampler makeSampler(ivec2 pixelCoord, int index){
+    Sampler sampler;
+    sampler.dimension = 0;
+    sampler.index = uint(index);
+    sampler.seed = hashUint(uint(pixelCoord.x) ^ hashUint(uint(pixelCoord.y)));
+    return sampler;
 }
 
 vec2 nextFloat2(inout Sampler sampler){
-    return vec2(nextFloat(sampler), nextFloat(sampler));
+    uint seed = hashUint(sampler.seed + uint(sampler.dimension) * 0x9e3779b9u);
+    sampler.dimension++;
+    uvec2 p = sobol2(nestedUniformScramble(sampler.index, seed));
+    p.x = nestedUniformScramble(p.x, hashUint(seed ^ 0x68bc21ebu));
+    p.y = nestedUniformScramble(p.y, hashUint(seed ^ 0x02e5be93u));
+    // 24 bits, as float(p) could round up to 1
+    return vec2(p >> 8) * (1.0 / 16777216.0);
+}
+
+float nextFloat(inout Sampler sampler){
+    return nextFloat2(sampler).x;
 }
 struct LocalFrame{
     vec3 N, T, B;
@@ -384,26 +699,16 @@ vec3 cosineHemisphereSampling(vec2 u){
     return vec3(d.x, sqrt(h), d.y);
 }
 
+// the sky view coordinates of a direction, see SkyLut::skyViewUv
+vec2 skyViewUv(vec3 d){
+    float azimuth = atan(d.z, d.x);
+    float elevation = asin(clamp(d.y, -1.0, 1.0));
+    float v = 0.5 + 0.5 * (elevation < 0.0 ? -1.0 : 1.0) * sqrt(abs(elevation) / (0.5 * M_PI));
+    return vec2(azimuth / (2.0 * M_PI) + 0.5, v);
+}
 vec3 LiBackground(vec3 o, vec3 d){
     if(0 != (options & ENABLE_ATMOSPHERE_SCATTERING)){
-        float theta = 45.0/180.0 * M_PI;
-        vec3 color = atmosphere(
-            normalize(d),                   // normalized ray direction
-            vec3(0,6372e3,0),               // ray origin
-            sunPos,                        // position of the sun
-            22.0,                           // intensity of the sun
-            6371e3,                         // radius of the planet in meters
-            6471e3,                         // radius of the atmosphere in meters
-            vec3(5.5e-6, 13.0e-6, 22.4e-6), // Rayleigh scattering coefficient
-            21e-6,                          // Mie scattering coefficient
-            8e3,                            // Rayleigh scale height
-            1.2e3,                          // Mie scale height
-            0.758                           // Mie preferred scattering direction
-        );
-
-        // Apply exposure.
-        color = 1.0 - exp(-1.0 * color);
-        return color;
+        return textureLod(skyView, skyViewUv(normalize(d)), 0.0).rgb;
     }else{
         return vec3(0);
     }
@@ -467,8 +772,7 @@ vec3 directLighting(LocalFrame frame, Intersection isct, vec3 wo){
     vec3 wi = worldToLocal(lightDir, frame);
     vec3 f = evaluateBSDF(isct.mat, wo, wi);
     if(any(greaterThan(f,vec3(0))) &&!occlude(isct.p, lightDir)){
-        vec3 Ke = LiBackground(vec3(0), sunPos);
-        return Ke * f * AbsCosTheta(wi);
+        return sunRadiance * f * AbsCosTheta(wi);
     }
     return vec3(0);
 }
@@ -515,9 +819,7 @@ void main() {
     if(any(greaterThanEqual(gl_GlobalInvocationID.xy, iResolution)))
         return;
     ivec2 pixelCoord = ivec2(gl_GlobalInvocationID.xy);
-    Sampler sampler;
-    sampler.dimension = 0;
-    sampler.seed = floatBitsToUint(imageLoad(seeds, pixelCoord).r);
+    Sampler sampler = makeSampler(pixelCoord, iTime);
     vec2 uv = (pixelCoord.xy + nextFloat2(sampler)) / iResolution;
 
 
@@ -535,6 +837,5 @@ void main() {
         color += prevColor;
     imageStore(composedImage, pixelCoord, vec4(pow(color.rgb / color.a,vec3(1.0/2.2)), 1.0));
     imageStore(accumlatedImage,  pixelCoord, color);
-    imageStore(seeds, pixelCoord, vec4(uintBitsToFloat(sampler.seed)));
 }
 )";
@@ -21,6 +21,17 @@
 
 #include "enkimi.h"
 
+#if defined( _WIN32 )
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 static const uint32_t SECTOR_SIZE = 4096;
 
@@ -38,6 +49,7 @@ static const char* tagIdString[] =
 	"TAG_List",
 	"TAG_Compound",
 	"TAG_Int_Array",
+	"TAG_Long_Array",
 };
 
 static uint32_t minecraftPalette[] = 
@@ -142,7 +154,7 @@ int enkiNBTInitFromMemoryCompressed( enkiNBTDataStream* pStream_, uint8_t * pCom
 		for( int attempts = 0; ( retval != MZ_OK ) && ( attempts < 3 ); ++attempts )
 		{
 			free( dataUnCompressed );
-			destLength *= 4 + 1024;
+			destLength = destLength * 4 + 1024;
 			dataUnCompressed = (uint8_t*)malloc( destLength );
 			retval = uncompress( dataUnCompressed, &destLength, pCompressedData_, compressedDataSize_ );
 		}
@@ -160,6 +172,285 @@ int enkiNBTInitFromMemoryCompressed( enkiNBTDataStream* pStream_, uint8_t * pCom
 	return 1;
 }
 
+void enkiInflateArenaInit( enkiInflateArena* pArena_ )
+{
+	memset( pArena_, 0, sizeof( enkiInflateArena ) );
+}
+
+void enkiInflateArenaFree( enkiInflateArena* pArena_ )
+{
+	free( pArena_->pBuffer );
+	enkiInflateArenaInit( pArena_ );
+}
+
+// grows the arena buffer to at least capacity_ bytes, returns 0 if out of memory
+static int ArenaReserve( enkiInflateArena* pArena_, size_t capacity_ )
+{
+	if( capacity_ <= pArena_->capacity )
+	{
+		return 1;
+	}
+	size_t newCapacity = pArena_->capacity ? pArena_->capacity * 2 : 1024;
+	while( newCapacity < capacity_ )
+	{
+		newCapacity *= 2;
+	}
+	uint8_t* pNewBuffer = (uint8_t*)realloc( pArena_->pBuffer, newCapacity );
+	if( !pNewBuffer )
+	{
+		return 0;
+	}
+	pArena_->pBuffer = pNewBuffer;
+	pArena_->capacity = newCapacity;
+	return 1;
+}
+
+static void ArenaStreamDone( enkiNBTDataStream* pStream_, enkiInflateArena* pArena_, uint8_t* pData_,
+							 size_t compressedSize_, size_t size_ )
+{
+	enkiNBTInitFromMemoryUncompressed( pStream_, pData_, ( uint32_t )size_ );
+	pArena_->compressedBytes += compressedSize_;
+	pArena_->uncompressedBytes += size_;
+	pArena_->streamCount++;
+}
+
+// inflates deflate data (zlib wrapped with TINFL_FLAG_PARSE_ZLIB_HEADER) into the arena
+static int InflateInArena( enkiNBTDataStream* pStream_, enkiInflateArena* pArena_,
+						   const uint8_t* pCompressedData_, size_t compressedDataSize_, int flags_ )
+{
+	tinfl_init( &pArena_->decompressor );
+	const uint8_t* pIn = pCompressedData_;
+	size_t inRemaining = compressedDataSize_;
+	size_t outSize = 0;
+	for( ;; )
+	{
+		// tinfl only keeps offsets into the output, so the buffer can move between calls
+		if( outSize == pArena_->capacity && !ArenaReserve( pArena_, outSize ? outSize * 2 : compressedDataSize_ * 4 + 1024 ) )
+		{
+			break;
+		}
+		size_t inBytes = inRemaining;
+		size_t outBytes = pArena_->capacity - outSize;
+		tinfl_status status = tinfl_decompress( &pArena_->decompressor, pIn, &inBytes, pArena_->pBuffer,
+												pArena_->pBuffer + outSize, &outBytes,
+												flags_ | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF );
+		pIn += inBytes;
+		inRemaining -= inBytes;
+		outSize += outBytes;
+		if( TINFL_STATUS_DONE == status )
+		{
+			ArenaStreamDone( pStream_, pArena_, pArena_->pBuffer, compressedDataSize_, outSize );
+			return 1;
+		}
+		if( TINFL_STATUS_HAS_MORE_OUTPUT != status )
+		{
+			break;
+		}
+	}
+	enkiNBTInitFromMemoryUncompressed( pStream_, NULL, 0 );
+	return 0;
+}
+
+int enkiNBTInitFromMemoryCompressedInArena( enkiNBTDataStream* pStream_, enkiInflateArena* pArena_,
+											uint8_t* pCompressedData_, uint32_t compressedDataSize_ )
+{
+	return InflateInArena( pStream_, pArena_, pCompressedData_, compressedDataSize_, TINFL_FLAG_PARSE_ZLIB_HEADER );
+}
+
+// gzip (RFC 1952) is a raw deflate stream between a header and a crc/size trailer
+static int GunzipInArena( enkiNBTDataStream* pStream_, enkiInflateArena* pArena_,
+						  const uint8_t* pCompressedData_, size_t compressedDataSize_ )
+{
+	enum { FHCRC = 2, FEXTRA = 4, FNAME = 8, FCOMMENT = 16 };
+	const uint8_t* pIn = pCompressedData_;
+	const uint8_t* pEnd = pCompressedData_ + compressedDataSize_;
+	if( compressedDataSize_ < 18 || pIn[ 0 ] != 0x1f || pIn[ 1 ] != 0x8b || pIn[ 2 ] != 8 )
+	{
+		enkiNBTInitFromMemoryUncompressed( pStream_, NULL, 0 );
+		return 0;
+	}
+	uint8_t flags = pIn[ 3 ];
+	pIn += 10;
+	if( flags & FEXTRA )
+	{
+		pIn += 2 + ( pIn[ 0 ] | ( pIn[ 1 ] << 8 ) );
+	}
+	for( int field = FNAME; field <= FCOMMENT; field <<= 1 )
+	{
+		if( flags & field )
+		{
+			while( pIn < pEnd && *pIn++ );
+		}
+	}
+	if( flags & FHCRC )
+	{
+		pIn += 2;
+	}
+	if( pIn + 8 > pEnd )
+	{
+		enkiNBTInitFromMemoryUncompressed( pStream_, NULL, 0 );
+		return 0;
+	}
+	if( !InflateInArena( pStream_, pArena_, pIn, ( size_t )( pEnd - pIn ) - 8, 0 ) )
+	{
+		return 0;
+	}
+	pArena_->compressedBytes += compressedDataSize_ - ( size_t )( pEnd - pIn - 8 );
+	return 1;
+}
+
+static uint32_t ReadLE32( const uint8_t* p )
+{
+	return ( uint32_t )p[ 0 ] | ( ( uint32_t )p[ 1 ] << 8 ) | ( ( uint32_t )p[ 2 ] << 16 ) | ( ( uint32_t )p[ 3 ] << 24 );
+}
+
+// Decodes an LZ4 block (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md) of exactly outSize_ bytes.
+// Away from the ends of the buffers literals and matches are copied 16 bytes at a time,
+// overrunning into bytes which later sequences overwrite.
+// returns 1 if successfull, 0 if the block is malformed.
+static int LZ4DecodeBlock( const uint8_t* pIn_, size_t inSize_, uint8_t* pOut_, size_t outSize_ )
+{
+	const uint8_t* pInEnd = pIn_ + inSize_;
+	uint8_t* pOutStart = pOut_;
+	uint8_t* pOutEnd = pOut_ + outSize_;
+	for( ;; )
+	{
+		if( pIn_ >= pInEnd )
+		{
+			return 0;
+		}
+		uint8_t token = *pIn_++;
+		size_t length = token >> 4;
+		if( 15 == length )
+		{
+			uint8_t add;
+			do
+			{
+				if( pIn_ >= pInEnd )
+				{
+					return 0;
+				}
+				add = *pIn_++;
+				length += add;
+			} while( 255 == add );
+		}
+		if( length > ( size_t )( pInEnd - pIn_ ) || length > ( size_t )( pOutEnd - pOut_ ) )
+		{
+			return 0;
+		}
+		if( length <= 16 && pInEnd - pIn_ >= 16 && pOutEnd - pOut_ >= 16 )
+		{
+			memcpy( pOut_, pIn_, 16 );
+		}
+		else
+		{
+			memcpy( pOut_, pIn_, length );
+		}
+		pIn_ += length;
+		pOut_ += length;
+		if( pOut_ == pOutEnd )
+		{
+			// the last sequence only has literals
+			return pIn_ == pInEnd;
+		}
+
+		if( pInEnd - pIn_ < 2 )
+		{
+			return 0;
+		}
+		size_t offset = pIn_[ 0 ] | ( pIn_[ 1 ] << 8 );
+		pIn_ += 2;
+		length = token & 15;
+		if( 15 == length )
+		{
+			uint8_t add;
+			do
+			{
+				if( pIn_ >= pInEnd )
+				{
+					return 0;
+				}
+				add = *pIn_++;
+				length += add;
+			} while( 255 == add );
+		}
+		length += 4;
+		if( 0 == offset || offset > ( size_t )( pOut_ - pOutStart ) || length > ( size_t )( pOutEnd - pOut_ ) )
+		{
+			return 0;
+		}
+		const uint8_t* pMatch = pOut_ - offset;
+		uint8_t* pCopyEnd = pOut_ + length;
+		if( offset >= 16 && pOutEnd - pCopyEnd >= 16 )
+		{
+			do
+			{
+				memcpy( pOut_, pMatch, 16 );
+				pOut_ += 16;
+				pMatch += 16;
+			} while( pOut_ < pCopyEnd );
+		}
+		else
+		{
+			// overlapping matches repeat the last offset bytes
+			while( pOut_ < pCopyEnd )
+			{
+				*pOut_++ = *pMatch++;
+			}
+		}
+		pOut_ = pCopyEnd;
+	}
+}
+
+// Decodes the LZ4 chunks of newer servers, which use the block stream of lz4-java's LZ4BlockOutputStream:
+// blocks each with a "LZ4Block" magic, a method token, little endian compressed, decompressed size
+// and checksum, ending with an empty block. The checksums are not verified. The sizes come from the file,
+// so blocks larger than lz4-java writes and chunks over MAX_CHUNK_SIZE are rejected before the arena grows.
+static int LZ4InArena( enkiNBTDataStream* pStream_, enkiInflateArena* pArena_,
+					   const uint8_t* pCompressedData_, size_t compressedDataSize_ )
+{
+	enum
+	{
+		HEADER_SIZE = 21,
+		METHOD_RAW = 0x10,
+		METHOD_LZ4 = 0x20,
+		MAX_BLOCK_SIZE = 1 << 25,
+		MAX_CHUNK_SIZE = 1 << 28
+	};
+	const uint8_t* pIn = pCompressedData_;
+	const uint8_t* pEnd = pCompressedData_ + compressedDataSize_;
+	size_t outSize = 0;
+	while( pEnd - pIn >= HEADER_SIZE && 0 == memcmp( pIn, "LZ4Block", 8 ) )
+	{
+		uint8_t method = pIn[ 8 ] & 0xf0;
+		uint32_t blockSize = ReadLE32( pIn + 9 );
+		uint32_t decodedSize = ReadLE32( pIn + 13 );
+		pIn += HEADER_SIZE;
+		if( 0 == decodedSize )
+		{
+			ArenaStreamDone( pStream_, pArena_, pArena_->pBuffer, compressedDataSize_, outSize );
+			return 1;
+		}
+		if( blockSize > ( size_t )( pEnd - pIn ) || decodedSize > MAX_BLOCK_SIZE ||
+			decodedSize > MAX_CHUNK_SIZE - outSize || !ArenaReserve( pArena_, outSize + decodedSize ) )
+		{
+			break;
+		}
+		if( METHOD_RAW == method && blockSize == decodedSize )
+		{
+			memcpy( pArena_->pBuffer + outSize, pIn, blockSize );
+		}
+		else if( METHOD_LZ4 != method || !LZ4DecodeBlock( pIn, blockSize, pArena_->pBuffer + outSize, decodedSize ) )
+		{
+			break;
+		}
+		pIn += blockSize;
+		outSize += decodedSize;
+	}
+	enkiNBTInitFromMemoryUncompressed( pStream_, NULL, 0 );
+	return 0;
+}
+
 void enkiNBTFreeAllocations( enkiNBTDataStream* pStream_ )
 {
 	free( pStream_->pAllocation );
@@ -289,6 +580,12 @@ static void SkipDataToNextTag( enkiNBTDataStream* pStream_ )
 		pStream_->pNextTag = pStream_->pCurrPos + length * 4; // array of ints (4 bytes)
 		break;
 	}
+	case enkiNBTTAG_Long_Array:
+	{
+		int32_t length = enkiNBTReadInt32( pStream_ );
+		pStream_->pNextTag = pStream_->pCurrPos + length * 8; // array of longs (8 bytes)
+		break;
+	}
 	default:
 		assert( 0 );
 		break;
@@ -398,46 +695,205 @@ enkiRegionFile enkiRegionFileLoad( FILE * fp_ )
 }
 
 
-uint8_t enkiHasChunk( enkiRegionFile regionFile_, int32_t chunkNr_ )
+enkiRegionFile enkiRegionFileMap( const char* pFilename_ )
 {
-	uint8_t hasChunk = 0;
+	enkiRegionFile regionFile;
+	enkiRegionFileInit( &regionFile );
+#if defined( _WIN32 )
+	HANDLE file = CreateFileA( pFilename_, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+							   OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL );
+	if( INVALID_HANDLE_VALUE == file )
+	{
+		return regionFile;
+	}
+	LARGE_INTEGER size;
+	if( GetFileSizeEx( file, &size ) && size.QuadPart >= ( LONGLONG )sizeof( RegionHeader ) )
+	{
+		HANDLE mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+		if( mapping )
+		{
+			// the view keeps the mapping alive, so both handles can be closed
+			regionFile.pRegionData = (uint8_t*)MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+			CloseHandle( mapping );
+		}
+	}
+	CloseHandle( file );
+	if( regionFile.pRegionData )
+	{
+		regionFile.regionDataSize = ( uint32_t )size.QuadPart;
+		regionFile.isMapped = 1;
+	}
+#else
+	int fd = open( pFilename_, O_RDONLY );
+	if( fd < 0 )
+	{
+		return regionFile;
+	}
+	struct stat st;
+	if( 0 == fstat( fd, &st ) && st.st_size >= ( off_t )sizeof( RegionHeader ) )
+	{
+		void* pMapping = mmap( NULL, ( size_t )st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if( MAP_FAILED != pMapping )
+		{
+			// chunks are visited in an arbitrary order, read ahead only on request
+			madvise( pMapping, ( size_t )st.st_size, MADV_RANDOM );
+			regionFile.pRegionData = (uint8_t*)pMapping;
+			regionFile.regionDataSize = ( uint32_t )st.st_size;
+			regionFile.isMapped = 1;
+		}
+	}
+	close( fd );
+#endif
+	return regionFile;
+}
+
+// returns the byte offset of the chunk in the region, or 0 if the chunk does not exist or is out of the file
+static uint32_t GetValidChunkLocation( enkiRegionFile regionFile_, int32_t chunkNr_ )
+{
+	if( !regionFile_.pRegionData )
+	{
+		return 0;
+	}
 	RegionHeader* header = (RegionHeader*)regionFile_.pRegionData;
 	uint32_t locationOffset = GetChunkLocation( header->sectionChunksInfos[ chunkNr_ ] );
-	if( locationOffset > sizeof( RegionHeader ) )
+	if( locationOffset <= sizeof( RegionHeader ) || locationOffset + 5 > regionFile_.regionDataSize )
 	{
-		hasChunk = 1;
+		return 0;
 	}
-	return hasChunk;
+	return locationOffset;
 }
 
-void enkiInitNBTDataStreamForChunk( enkiRegionFile regionFile_, int32_t chunkNr_, enkiNBTDataStream* pStream_ )
+void enkiPrefetchChunk( enkiRegionFile regionFile_, int32_t chunkNr_ )
 {
+	uint32_t locationOffset = GetValidChunkLocation( regionFile_, chunkNr_ );
+	if( !regionFile_.isMapped || !locationOffset )
+	{
+		return;
+	}
+#if !defined( _WIN32 )
 	RegionHeader* header = (RegionHeader*)regionFile_.pRegionData;
-	uint32_t locationOffset = GetChunkLocation( header->sectionChunksInfos[ chunkNr_ ] );
-	if( locationOffset > sizeof( RegionHeader ) )
+	uint32_t length = header->sectionChunksInfos[ chunkNr_ ].sectorCount * SECTOR_SIZE;
+	if( locationOffset + length > regionFile_.regionDataSize )
 	{
-		uint32_t length = Get32BitInt(  *( BigEndian4BytesTo32BitInt* )&regionFile_.pRegionData[ locationOffset ] );
-		uint8_t compression_type = regionFile_.pRegionData[ locationOffset + 4 ]; // we ignore this as unused for now
-		--length; // length includes compression_type
-		// get the data and decompress it
-		uint8_t* dataCompressed = &regionFile_.pRegionData[ locationOffset + 5 ];
-		enkiNBTInitFromMemoryCompressed( pStream_, dataCompressed, length, 0 );
+		length = regionFile_.regionDataSize - locationOffset;
+	}
+	// sectors are page aligned as SECTOR_SIZE is a multiple of the page size
+	madvise( regionFile_.pRegionData + locationOffset, length, MADV_WILLNEED );
+#endif
+}
+
+uint8_t enkiHasChunk( enkiRegionFile regionFile_, int32_t chunkNr_ )
+{
+	return GetValidChunkLocation( regionFile_, chunkNr_ ) ? 1 : 0;
+}
+
+// returns the compressed chunk payload, its size and compression type, or NULL if the chunk does not exist
+static uint8_t* GetChunkCompressedData( enkiRegionFile regionFile_, int32_t chunkNr_, uint32_t* pLength_,
+										uint8_t* pCompression_ )
+{
+	uint32_t locationOffset = GetValidChunkLocation( regionFile_, chunkNr_ );
+	uint32_t length = 0;
+	if( locationOffset )
+	{
+		length = Get32BitInt(  *( BigEndian4BytesTo32BitInt* )&regionFile_.pRegionData[ locationOffset ] );
+	}
+	if( length > 1 && length <= regionFile_.regionDataSize - locationOffset - 4 )
+	{
+		*pCompression_ = regionFile_.pRegionData[ locationOffset + 4 ];
+		*pLength_ = length - 1; // length includes compression_type
+		return &regionFile_.pRegionData[ locationOffset + 5 ];
+	}
+	return NULL;
+}
+
+static void InitNBTDataStreamForChunk( enkiRegionFile regionFile_, int32_t chunkNr_, enkiNBTDataStream* pStream_,
+									   enkiInflateArena* pArena_, int copyUncompressed_ );
+
+void enkiInitNBTDataStreamForChunk( enkiRegionFile regionFile_, int32_t chunkNr_, enkiNBTDataStream* pStream_ )
+{
+	enkiInflateArena arena;
+	enkiInflateArenaInit( &arena );
+	// enkiNBTReadNextTag writes into the stream, which a read only mapping does not allow
+	InitNBTDataStreamForChunk( regionFile_, chunkNr_, pStream_, &arena, regionFile_.isMapped );
+	if( pStream_->pData && pStream_->pData == arena.pBuffer )
+	{
+		pStream_->pAllocation = arena.pBuffer; // the stream takes over the buffer
 	}
 	else
 	{
+		free( arena.pBuffer );
+	}
+}
+
+void enkiInitNBTDataStreamForChunkInArena( enkiRegionFile regionFile_, int32_t chunkNr_, enkiNBTDataStream* pStream_,
+										   enkiInflateArena* pArena_ )
+{
+	InitNBTDataStreamForChunk( regionFile_, chunkNr_, pStream_, pArena_, 0 );
+}
+
+static void InitNBTDataStreamForChunk( enkiRegionFile regionFile_, int32_t chunkNr_, enkiNBTDataStream* pStream_,
+									   enkiInflateArena* pArena_, int copyUncompressed_ )
+{
+	uint32_t length;
+	uint8_t compression = 0;
+	uint8_t* dataCompressed = GetChunkCompressedData( regionFile_, chunkNr_, &length, &compression );
+	switch( dataCompressed ? compression : 0 )
+	{
+	case enkiChunkCompression_GZip:
+		GunzipInArena( pStream_, pArena_, dataCompressed, length );
+		break;
+	case enkiChunkCompression_Zlib:
+		InflateInArena( pStream_, pArena_, dataCompressed, length, TINFL_FLAG_PARSE_ZLIB_HEADER );
+		break;
+	case enkiChunkCompression_None:
+		if( !copyUncompressed_ )
+		{
+			ArenaStreamDone( pStream_, pArena_, dataCompressed, length, length );
+		}
+		else if( ArenaReserve( pArena_, length ) )
+		{
+			memcpy( pArena_->pBuffer, dataCompressed, length );
+			ArenaStreamDone( pStream_, pArena_, pArena_->pBuffer, length, length );
+		}
+		else
+		{
+			enkiNBTInitFromMemoryUncompressed( pStream_, NULL, 0 );
+		}
+		break;
+	case enkiChunkCompression_LZ4:
+		LZ4InArena( pStream_, pArena_, dataCompressed, length );
+		break;
+	default:
+		// missing chunk, chunk stored in an external .mcc file (type | 128) or unknown compression
 		enkiNBTInitFromMemoryUncompressed( pStream_, NULL, 0 ); // clears stream
+		break;
 	}
 }
 
 int32_t enkiGetTimestampForChunk( enkiRegionFile regionFile_, int32_t chunkNr_ )
 {
+	if( !regionFile_.pRegionData )
+	{
+		return 0;
+	}
 	RegionHeader* header = (RegionHeader*)regionFile_.pRegionData;
 	return Get32BitInt( header->sectionChunksTimestamps[ chunkNr_ ] );
 }
 
 void enkiRegionFileFreeAllocations(enkiRegionFile * pRegionFile_)
 {
-	free( pRegionFile_->pRegionData );
+	if( pRegionFile_->isMapped )
+	{
+#if defined( _WIN32 )
+		UnmapViewOfFile( pRegionFile_->pRegionData );
+#else
+		munmap( pRegionFile_->pRegionData, pRegionFile_->regionDataSize );
+#endif
+	}
+	else
+	{
+		free( pRegionFile_->pRegionData );
+	}
 	memset( pRegionFile_, 0, sizeof(enkiRegionFile) );
 }
 
@@ -505,9 +961,11 @@ enkiChunkBlockData enkiNBTReadChunk( enkiNBTDataStream * pStream_ )
 						{
 							sectionY = enkiNBTReadInt8( pStream_ );
 						}
-						if( pBlocks && ( 0 <= sectionY ) )
+						// only Y 0 to 15 existed in this format
+						if( pBlocks && ( 0 <= sectionY ) &&
+							( sectionY < ENKI_MI_NUM_SECTIONS_PER_CHUNK + ENKI_MI_MIN_SECTION_Y ) )
 						{
-							chunk.sections[ sectionY ] = pBlocks;
+							chunk.sections[ sectionY - ENKI_MI_MIN_SECTION_Y ] = pBlocks;
 							sectionY = -1;
 							pBlocks = NULL;
 						}
@@ -526,6 +984,689 @@ enkiChunkBlockData enkiNBTReadChunk( enkiNBTDataStream * pStream_ )
 	return chunk;
 }
 
+// FNV-1a hashes of the tag names enkiNBTScanChunk looks for
+#define NAME_HASH_LEVEL    0x4155597du
+#define NAME_HASH_XPOS     0x9e6a0127u
+#define NAME_HASH_ZPOS     0x0b5703d1u
+#define NAME_HASH_SECTIONS 0xcb46d1cdu
+#define NAME_HASH_BLOCKS   0x036a71e3u
+#define NAME_HASH_Y        0xdc0c1c94u
+// 1.13 to 1.17 palette sections
+#define NAME_HASH_PALETTE      0x7e082040u
+#define NAME_HASH_BLOCK_STATES 0x835b713cu
+// 1.18 onwards: sections at the root, palette and data in a block_states compound
+#define NAME_HASH_SECTIONS_LOWER     0xcefb10adu
+#define NAME_HASH_BLOCK_STATES_LOWER 0x1baeeda1u
+#define NAME_HASH_PALETTE_LOWER      0xf4ece2a0u
+#define NAME_HASH_DATA               0xd872e2a5u
+#define NAME_HASH_NAME               0x0fe07306u
+
+#define SCAN_MAX_DEPTH 512
+
+typedef struct NBTScanner_s
+{
+	const uint8_t* pCurr;
+	const uint8_t* pEnd;
+} NBTScanner;
+
+typedef struct NBTScanName_s
+{
+	const char* pName;
+	uint16_t    length;
+	uint32_t    hash;
+} NBTScanName;
+
+static uint32_t HashName( const uint8_t* pName_, uint16_t length_ )
+{
+	uint32_t hash = 2166136261u;
+	for( uint16_t i = 0; i < length_; ++i )
+	{
+		hash = ( hash ^ pName_[ i ] ) * 16777619u;
+	}
+	return hash;
+}
+
+static int ScanHas( const NBTScanner* pScan_, size_t bytes_ )
+{
+	return ( size_t )( pScan_->pEnd - pScan_->pCurr ) >= bytes_;
+}
+
+static int32_t ScanInt32( NBTScanner* pScan_ )
+{
+	const uint8_t* p = pScan_->pCurr;
+	pScan_->pCurr += 4;
+	return ( int32_t )( ( ( uint32_t )p[ 0 ] << 24 ) | ( ( uint32_t )p[ 1 ] << 16 ) | ( ( uint32_t )p[ 2 ] << 8 ) | p[ 3 ] );
+}
+
+// reads a tag header, returns 0 at the end of the data.
+// pName_ is filled for every tag but TAG_End.
+static int ScanTagHeader( NBTScanner* pScan_, uint8_t* pTagId_, NBTScanName* pName_ )
+{
+	if( !ScanHas( pScan_, 1 ) )
+	{
+		return 0;
+	}
+	*pTagId_ = *pScan_->pCurr++;
+	if( enkiNBTTAG_End == *pTagId_ )
+	{
+		return 1;
+	}
+	if( !ScanHas( pScan_, 2 ) )
+	{
+		return 0;
+	}
+	pName_->length = ( uint16_t )( ( pScan_->pCurr[ 0 ] << 8 ) | pScan_->pCurr[ 1 ] );
+	pScan_->pCurr += 2;
+	if( !ScanHas( pScan_, pName_->length ) )
+	{
+		return 0;
+	}
+	pName_->pName = ( const char* )pScan_->pCurr;
+	pName_->hash = HashName( pScan_->pCurr, pName_->length );
+	pScan_->pCurr += pName_->length;
+	return 1;
+}
+
+static int ScanNameIs( const NBTScanName* pName_, uint32_t hash_, const char* pExpected_ )
+{
+	// the hash rejects almost everything, confirm a match to be safe from collisions
+	return pName_->hash == hash_ && strlen( pExpected_ ) == pName_->length &&
+		   0 == memcmp( pName_->pName, pExpected_, pName_->length );
+}
+
+// size of the payload of fixed size tags, 0 for variable size ones
+static uint32_t FixedPayloadSize( uint8_t tagId_ )
+{
+	switch( tagId_ )
+	{
+	case enkiNBTTAG_Byte:   return 1;
+	case enkiNBTTAG_Short:  return 2;
+	case enkiNBTTAG_Int:    return 4;
+	case enkiNBTTAG_Long:   return 8;
+	case enkiNBTTAG_Float:  return 4;
+	case enkiNBTTAG_Double: return 8;
+	default:                return 0;
+	}
+}
+
+// skips the payload of a tag without looking at any names, returns 0 if the data is malformed.
+static int ScanSkipPayload( NBTScanner* pScan_, uint8_t tagId_, int depth_ )
+{
+	if( depth_ > SCAN_MAX_DEPTH )
+	{
+		return 0;
+	}
+	uint32_t fixedSize = FixedPayloadSize( tagId_ );
+	if( fixedSize )
+	{
+		if( !ScanHas( pScan_, fixedSize ) )
+		{
+			return 0;
+		}
+		pScan_->pCurr += fixedSize;
+		return 1;
+	}
+	switch( tagId_ )
+	{
+	case enkiNBTTAG_Byte_Array:
+	case enkiNBTTAG_Int_Array:
+	case enkiNBTTAG_Long_Array:
+	{
+		if( !ScanHas( pScan_, 4 ) )
+		{
+			return 0;
+		}
+		int32_t length = ScanInt32( pScan_ );
+		uint64_t elementSize = enkiNBTTAG_Byte_Array == tagId_ ? 1 : ( enkiNBTTAG_Int_Array == tagId_ ? 4 : 8 );
+		if( length < 0 || !ScanHas( pScan_, ( size_t )( elementSize * ( uint64_t )length ) ) )
+		{
+			return 0;
+		}
+		pScan_->pCurr += elementSize * ( uint64_t )length;
+		return 1;
+	}
+	case enkiNBTTAG_String:
+	{
+		if( !ScanHas( pScan_, 2 ) )
+		{
+			return 0;
+		}
+		uint16_t length = ( uint16_t )( ( pScan_->pCurr[ 0 ] << 8 ) | pScan_->pCurr[ 1 ] );
+		pScan_->pCurr += 2;
+		if( !ScanHas( pScan_, length ) )
+		{
+			return 0;
+		}
+		pScan_->pCurr += length;
+		return 1;
+	}
+	case enkiNBTTAG_List:
+	{
+		if( !ScanHas( pScan_, 5 ) )
+		{
+			return 0;
+		}
+		uint8_t itemTagId = *pScan_->pCurr++;
+		int32_t numItems = ScanInt32( pScan_ );
+		if( numItems <= 0 )
+		{
+			return 1;
+		}
+		fixedSize = FixedPayloadSize( itemTagId );
+		if( fixedSize )
+		{
+			if( !ScanHas( pScan_, ( size_t )fixedSize * ( uint32_t )numItems ) )
+			{
+				return 0;
+			}
+			pScan_->pCurr += ( size_t )fixedSize * ( uint32_t )numItems;
+			return 1;
+		}
+		for( int32_t item = 0; item < numItems; ++item )
+		{
+			if( !ScanSkipPayload( pScan_, itemTagId, depth_ + 1 ) )
+			{
+				return 0;
+			}
+		}
+		return 1;
+	}
+	case enkiNBTTAG_Compound:
+	{
+		uint8_t tagId;
+		NBTScanName name;
+		while( ScanTagHeader( pScan_, &tagId, &name ) )
+		{
+			if( enkiNBTTAG_End == tagId )
+			{
+				return 1;
+			}
+			if( !ScanSkipPayload( pScan_, tagId, depth_ + 1 ) )
+			{
+				return 0;
+			}
+		}
+		return 0;
+	}
+	default:
+		return 0;
+	}
+}
+
+// records a palette list of compounds, the scanner is positioned after it on success
+static int ScanPalette( NBTScanner* pScan_, enkiChunkSectionPalette* pPalette_ )
+{
+	if( !ScanHas( pScan_, 5 ) || enkiNBTTAG_Compound != pScan_->pCurr[ 0 ] )
+	{
+		return ScanSkipPayload( pScan_, enkiNBTTAG_List, 0 );
+	}
+	const uint8_t* pItems = pScan_->pCurr + 5;
+	int32_t numItems = ( int32_t )( ( ( uint32_t )pScan_->pCurr[ 1 ] << 24 ) | ( ( uint32_t )pScan_->pCurr[ 2 ] << 16 ) |
+									( ( uint32_t )pScan_->pCurr[ 3 ] << 8 ) | pScan_->pCurr[ 4 ] );
+	if( !ScanSkipPayload( pScan_, enkiNBTTAG_List, 0 ) )
+	{
+		return 0;
+	}
+	if( numItems > 0 )
+	{
+		pPalette_->pPalette = pItems;
+		pPalette_->pPaletteEnd = pScan_->pCurr;
+		pPalette_->paletteSize = numItems;
+	}
+	return 1;
+}
+
+// records a long array of block states, the scanner is positioned after it on success
+static int ScanBlockStates( NBTScanner* pScan_, enkiChunkSectionPalette* pPalette_ )
+{
+	const uint8_t* pArray = pScan_->pCurr + 4;
+	if( !ScanHas( pScan_, 4 ) )
+	{
+		return 0;
+	}
+	int32_t length = ScanInt32( pScan_ );
+	pScan_->pCurr -= 4;
+	if( !ScanSkipPayload( pScan_, enkiNBTTAG_Long_Array, 0 ) )
+	{
+		return 0;
+	}
+	pPalette_->pBlockStates = length > 0 ? pArray : NULL;
+	pPalette_->numBlockStates = length > 0 ? length : 0;
+	return 1;
+}
+
+// scans the block_states compound of a 1.18 section, the scanner is positioned after its End tag on success
+static int ScanBlockStatesCompound( NBTScanner* pScan_, enkiChunkSectionPalette* pPalette_ )
+{
+	uint8_t tagId;
+	NBTScanName name;
+	while( ScanTagHeader( pScan_, &tagId, &name ) )
+	{
+		int ok;
+		if( enkiNBTTAG_End == tagId )
+		{
+			return 1;
+		}
+		if( enkiNBTTAG_List == tagId && ScanNameIs( &name, NAME_HASH_PALETTE_LOWER, "palette" ) )
+		{
+			ok = ScanPalette( pScan_, pPalette_ );
+		}
+		else if( enkiNBTTAG_Long_Array == tagId && ScanNameIs( &name, NAME_HASH_DATA, "data" ) )
+		{
+			ok = ScanBlockStates( pScan_, pPalette_ );
+		}
+		else
+		{
+			ok = ScanSkipPayload( pScan_, tagId, 0 );
+		}
+		if( !ok )
+		{
+			return 0;
+		}
+	}
+	return 0;
+}
+
+// scans one compound of the Sections list, the scanner is positioned after its End tag on success
+static int ScanSection( NBTScanner* pScan_, enkiChunkBlockData* pChunk_ )
+{
+	int32_t sectionY = INT32_MIN;
+	const uint8_t* pBlocks = NULL;
+	enkiChunkSectionPalette palette;
+	memset( &palette, 0, sizeof( palette ) );
+	uint8_t tagId;
+	NBTScanName name;
+	while( ScanTagHeader( pScan_, &tagId, &name ) )
+	{
+		if( enkiNBTTAG_End == tagId )
+		{
+			int32_t section = sectionY - ENKI_MI_MIN_SECTION_Y;
+			if( 0 <= section && section < ENKI_MI_NUM_SECTIONS_PER_CHUNK )
+			{
+				if( pBlocks )
+				{
+					pChunk_->sections[ section ] = ( uint8_t* )pBlocks;
+				}
+				else if( palette.pPalette )
+				{
+					pChunk_->palettes[ section ] = palette;
+				}
+			}
+			else if( INT32_MIN != sectionY && ( pBlocks || palette.pPalette ) )
+			{
+				pChunk_->countOfDroppedSections++;
+			}
+			return 1;
+		}
+		if( enkiNBTTAG_Byte == tagId && ScanNameIs( &name, NAME_HASH_Y, "Y" ) )
+		{
+			if( !ScanHas( pScan_, 1 ) )
+			{
+				return 0;
+			}
+			sectionY = ( int8_t )*pScan_->pCurr++;
+			continue;
+		}
+		if( enkiNBTTAG_Byte_Array == tagId && ScanNameIs( &name, NAME_HASH_BLOCKS, "Blocks" ) )
+		{
+			const uint8_t* pArray = pScan_->pCurr + 4;
+			if( !ScanSkipPayload( pScan_, tagId, 0 ) )
+			{
+				return 0;
+			}
+			if( pScan_->pCurr - pArray >= ENKI_MI_SIZE_SECTIONS * ENKI_MI_SIZE_SECTIONS * ENKI_MI_SIZE_SECTIONS )
+			{
+				pBlocks = pArray;
+			}
+			continue;
+		}
+		int ok;
+		if( enkiNBTTAG_List == tagId && ScanNameIs( &name, NAME_HASH_PALETTE, "Palette" ) )
+		{
+			ok = ScanPalette( pScan_, &palette );
+		}
+		else if( enkiNBTTAG_Long_Array == tagId && ScanNameIs( &name, NAME_HASH_BLOCK_STATES, "BlockStates" ) )
+		{
+			ok = ScanBlockStates( pScan_, &palette );
+		}
+		else if( enkiNBTTAG_Compound == tagId && ScanNameIs( &name, NAME_HASH_BLOCK_STATES_LOWER, "block_states" ) )
+		{
+			ok = ScanBlockStatesCompound( pScan_, &palette );
+		}
+		else
+		{
+			ok = ScanSkipPayload( pScan_, tagId, 0 );
+		}
+		if( !ok )
+		{
+			return 0;
+		}
+	}
+	return 0;
+}
+
+// flags of the tags a chunk needs
+#define SCAN_FOUND_XPOS     1
+#define SCAN_FOUND_ZPOS     2
+#define SCAN_FOUND_SECTIONS 4
+#define SCAN_FOUND_ALL      7
+
+// scans a tag of the compound holding the chunk, Level before 1.18 and the root after.
+// Returns 0 if the data is malformed.
+static int ScanChunkTag( NBTScanner* pScan_, uint8_t tagId_, const NBTScanName* pName_, enkiChunkBlockData* pChunk_,
+						 int* pFound_ )
+{
+	if( enkiNBTTAG_Int == tagId_ && ScanNameIs( pName_, NAME_HASH_XPOS, "xPos" ) && ScanHas( pScan_, 4 ) )
+	{
+		*pFound_ |= SCAN_FOUND_XPOS;
+		pChunk_->xPos = ScanInt32( pScan_ );
+		return 1;
+	}
+	if( enkiNBTTAG_Int == tagId_ && ScanNameIs( pName_, NAME_HASH_ZPOS, "zPos" ) && ScanHas( pScan_, 4 ) )
+	{
+		*pFound_ |= SCAN_FOUND_ZPOS;
+		pChunk_->zPos = ScanInt32( pScan_ );
+		return 1;
+	}
+	if( enkiNBTTAG_List == tagId_ && ScanHas( pScan_, 5 ) &&
+		( ScanNameIs( pName_, NAME_HASH_SECTIONS, "Sections" ) ||
+		  ScanNameIs( pName_, NAME_HASH_SECTIONS_LOWER, "sections" ) ) )
+	{
+		*pFound_ |= SCAN_FOUND_SECTIONS;
+		uint8_t itemTagId = *pScan_->pCurr++;
+		int32_t numItems = ScanInt32( pScan_ );
+		for( int32_t item = 0; item < numItems; ++item )
+		{
+			if( enkiNBTTAG_Compound != itemTagId || !ScanSection( pScan_, pChunk_ ) )
+			{
+				return 0;
+			}
+			pChunk_->countOfSections++;
+		}
+		return 1;
+	}
+	return ScanSkipPayload( pScan_, tagId_, 0 );
+}
+
+enkiChunkBlockData enkiNBTScanChunk( const enkiNBTDataStream* pStream_ )
+{
+	enkiChunkBlockData chunk;
+	enkiChunkInit( &chunk );
+	NBTScanner scan;
+	scan.pCurr = pStream_->pData;
+	scan.pEnd = pStream_->pData + pStream_->dataLength;
+
+	// root compound
+	uint8_t tagId;
+	NBTScanName name;
+	if( !scan.pCurr || !ScanTagHeader( &scan, &tagId, &name ) || enkiNBTTAG_Compound != tagId )
+	{
+		return chunk;
+	}
+	// find Level, the chunk tags being at the root from 1.18
+	int found = 0;
+	int foundLevel = 0;
+	while( !foundLevel && found != SCAN_FOUND_ALL && ScanTagHeader( &scan, &tagId, &name ) &&
+		   enkiNBTTAG_End != tagId )
+	{
+		if( enkiNBTTAG_Compound == tagId && ScanNameIs( &name, NAME_HASH_LEVEL, "Level" ) )
+		{
+			foundLevel = 1;
+		}
+		else if( !ScanChunkTag( &scan, tagId, &name, &chunk, &found ) )
+		{
+			enkiChunkInit( &chunk );
+			return chunk;
+		}
+	}
+	while( foundLevel && found != SCAN_FOUND_ALL && ScanTagHeader( &scan, &tagId, &name ) &&
+		   enkiNBTTAG_End != tagId )
+	{
+		if( !ScanChunkTag( &scan, tagId, &name, &chunk, &found ) )
+		{
+			break;
+		}
+	}
+	if( found != SCAN_FOUND_ALL )
+	{
+		// reset to empty
+		enkiChunkInit( &chunk );
+	}
+	return chunk;
+}
+
+int32_t enkiGetSectionPaletteNames( const enkiChunkSectionPalette* pPalette_, const char** ppNames_,
+									uint16_t* pNameLengths_, int32_t maxNames_ )
+{
+	NBTScanner scan;
+	scan.pCurr = pPalette_->pPalette;
+	scan.pEnd = pPalette_->pPaletteEnd;
+	int32_t count = pPalette_->paletteSize < maxNames_ ? pPalette_->paletteSize : maxNames_;
+	for( int32_t entry = 0; entry < count; ++entry )
+	{
+		uint8_t tagId;
+		NBTScanName name;
+		ppNames_[ entry ] = NULL;
+		pNameLengths_[ entry ] = 0;
+		while( 1 )
+		{
+			if( !ScanTagHeader( &scan, &tagId, &name ) )
+			{
+				return -1;
+			}
+			if( enkiNBTTAG_End == tagId )
+			{
+				break;
+			}
+			if( enkiNBTTAG_String == tagId && ScanNameIs( &name, NAME_HASH_NAME, "Name" ) && ScanHas( &scan, 2 ) )
+			{
+				uint16_t length = ( uint16_t )( ( scan.pCurr[ 0 ] << 8 ) | scan.pCurr[ 1 ] );
+				ppNames_[ entry ] = ( const char* )scan.pCurr + 2;
+				pNameLengths_[ entry ] = length;
+			}
+			if( !ScanSkipPayload( &scan, tagId, 0 ) )
+			{
+				return -1;
+			}
+		}
+	}
+	return count;
+}
+
+#define BLOCKS_PER_SECTION ( ENKI_MI_SIZE_SECTIONS * ENKI_MI_SIZE_SECTIONS * ENKI_MI_SIZE_SECTIONS )
+
+static uint64_t ReadLong( const uint8_t* p )
+{
+	return ( ( uint64_t )p[ 0 ] << 56 ) | ( ( uint64_t )p[ 1 ] << 48 ) | ( ( uint64_t )p[ 2 ] << 40 ) |
+		   ( ( uint64_t )p[ 3 ] << 32 ) | ( ( uint64_t )p[ 4 ] << 24 ) | ( ( uint64_t )p[ 5 ] << 16 ) |
+		   ( ( uint64_t )p[ 6 ] << 8 ) | p[ 7 ];
+}
+
+// 1.16 onwards: each long holds 64 / bits indices, the lowest first, and the remaining bits are unused.
+// Called with a constant bits_ so the inner loop is unrolled for each width.
+static inline void UnpackAligned( const uint8_t* pLongs_, int bits_, const uint8_t* pLut_, uint8_t* pBlocks_ )
+{
+	const int perLong = 64 / bits_;
+	const uint64_t mask = ( ( uint64_t )1 << bits_ ) - 1;
+	int block = 0;
+	for( ; block + perLong <= BLOCKS_PER_SECTION; block += perLong, pLongs_ += 8 )
+	{
+		uint64_t bits = ReadLong( pLongs_ );
+		for( int i = 0; i < perLong; ++i, bits >>= bits_ )
+		{
+			pBlocks_[ block + i ] = pLut_[ bits & mask ];
+		}
+	}
+	uint64_t bits = block < BLOCKS_PER_SECTION ? ReadLong( pLongs_ ) : 0;
+	for( ; block < BLOCKS_PER_SECTION; ++block, bits >>= bits_ )
+	{
+		pBlocks_[ block ] = pLut_[ bits & mask ];
+	}
+}
+
+// 1.13 to 1.15: the indices are a continuous bit stream, an index may straddle two longs
+static inline void UnpackStraddling( const uint8_t* pLongs_, int bits_, const uint8_t* pLut_, uint8_t* pBlocks_ )
+{
+	const uint64_t mask = ( ( uint64_t )1 << bits_ ) - 1;
+	uint64_t current = ReadLong( pLongs_ );
+	int offset = 0;
+	for( int block = 0; block < BLOCKS_PER_SECTION; ++block )
+	{
+		uint64_t index = current >> offset;
+		offset += bits_;
+		if( offset >= 64 )
+		{
+			offset -= 64;
+			pLongs_ += 8;
+			// the last index ends exactly at the end of the array
+			current = block + 1 < BLOCKS_PER_SECTION ? ReadLong( pLongs_ ) : 0;
+			if( offset )
+			{
+				index |= current << ( bits_ - offset );
+			}
+		}
+		pBlocks_[ block ] = pLut_[ index & mask ];
+	}
+}
+
+#if ( defined( __GNUC__ ) || defined( __clang__ ) ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#include <immintrin.h>
+#define ENKI_MI_HAS_SSSE3_UNPACK
+
+// 4 bit indices, the most common width, looked up 32 at a time with pshufb.
+// The layouts agree at this width as 16 indices fill a long exactly.
+__attribute__( ( target( "ssse3" ) ) ) static void Unpack4BitsSSSE3( const uint8_t* pLongs_, const uint8_t* pLut_,
+																	uint8_t* pBlocks_ )
+{
+	// byte swaps two big endian longs, leaving byte i holding indices 2i and 2i + 1
+	const __m128i swap = _mm_setr_epi8( 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 );
+	const __m128i lut = _mm_loadu_si128( ( const __m128i* )pLut_ );
+	const __m128i low = _mm_set1_epi8( 0x0f );
+	for( int i = 0; i < BLOCKS_PER_SECTION / 32; ++i )
+	{
+		__m128i bytes = _mm_shuffle_epi8( _mm_loadu_si128( ( const __m128i* )( pLongs_ + 16 * i ) ), swap );
+		__m128i even = _mm_shuffle_epi8( lut, _mm_and_si128( bytes, low ) );
+		__m128i odd = _mm_shuffle_epi8( lut, _mm_and_si128( _mm_srli_epi16( bytes, 4 ), low ) );
+		_mm_storeu_si128( ( __m128i* )( pBlocks_ + 32 * i ), _mm_unpacklo_epi8( even, odd ) );
+		_mm_storeu_si128( ( __m128i* )( pBlocks_ + 32 * i + 16 ), _mm_unpackhi_epi8( even, odd ) );
+	}
+}
+
+// 1.13 to 1.15 indices of 5 to 12 bits, 8 at a time. Once the longs are byte swapped into a little
+// endian bit stream every group of 8 indices starts on a byte, so one 16 byte load holds it. pshufb
+// moves the 4 bytes under each index into its lane, a per lane shift and mask leave the index and
+// the block id is gathered from pLut_, which must be readable 3 bytes past its last entry.
+// The 1.16 layout, which 8 bit indices match too, stays scalar: repacking it into a stream costs
+// what the shuffles save.
+__attribute__( ( target( "avx2" ) ) ) static void UnpackStraddlingAVX2( const uint8_t* pLongs_, int32_t numLongs_,
+																	   int bits_, const uint8_t* pLut_, uint8_t* pBlocks_ )
+{
+	uint8_t stream[ BLOCKS_PER_SECTION * 12 / 8 + 16 ];
+	const __m128i swap = _mm_setr_epi8( 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 );
+	int32_t i = 0;
+	for( ; i + 2 <= numLongs_; i += 2 )
+	{
+		__m128i longs = _mm_loadu_si128( ( const __m128i* )( pLongs_ + 8 * i ) );
+		_mm_storeu_si128( ( __m128i* )( stream + 8 * i ), _mm_shuffle_epi8( longs, swap ) );
+	}
+	for( ; i < numLongs_; ++i )
+	{
+		uint64_t bits = ReadLong( pLongs_ + 8 * i );
+		memcpy( stream + 8 * i, &bits, 8 );
+	}
+	memset( stream + 8 * numLongs_, 0, 16 );
+
+	uint8_t control[ 32 ];
+	uint32_t shifts[ 8 ];
+	for( i = 0; i < 8; ++i )
+	{
+		for( int k = 0; k < 4; ++k )
+		{
+			control[ 4 * i + k ] = ( uint8_t )( i * bits_ / 8 + k );
+		}
+		shifts[ i ] = ( uint32_t )( i * bits_ % 8 );
+	}
+	const __m256i gather = _mm256_loadu_si256( ( const __m256i* )control );
+	const __m256i shift = _mm256_loadu_si256( ( const __m256i* )shifts );
+	const __m256i mask = _mm256_set1_epi32( ( 1 << bits_ ) - 1 );
+	const __m256i byteMask = _mm256_set1_epi32( 0xff );
+	for( int group = 0; group < BLOCKS_PER_SECTION / 8; ++group )
+	{
+		__m256i bytes = _mm256_broadcastsi128_si256( _mm_loadu_si128( ( const __m128i* )( stream + group * bits_ ) ) );
+		__m256i index = _mm256_and_si256( _mm256_srlv_epi32( _mm256_shuffle_epi8( bytes, gather ), shift ), mask );
+		__m256i id = _mm256_and_si256( _mm256_i32gather_epi32( ( const int* )pLut_, index, 1 ), byteMask );
+		__m128i id16 = _mm_packus_epi32( _mm256_castsi256_si128( id ), _mm256_extracti128_si256( id, 1 ) );
+		_mm_storel_epi64( ( __m128i* )( pBlocks_ + 8 * group ), _mm_packus_epi16( id16, id16 ) );
+	}
+}
+#endif
+
+#define UNPACK_WIDTH( BITS )                                      \
+	case BITS:                                                    \
+		if( straddling )                                          \
+			UnpackStraddling( pPalette_->pBlockStates, BITS, lut, pBlocks_ ); \
+		else                                                      \
+			UnpackAligned( pPalette_->pBlockStates, BITS, lut, pBlocks_ );    \
+		break;
+
+int enkiUnpackBlockStates( const enkiChunkSectionPalette* pPalette_, const uint8_t* pLookup_, uint8_t* pBlocks_ )
+{
+	if( pPalette_->paletteSize <= 0 || pPalette_->paletteSize > BLOCKS_PER_SECTION )
+	{
+		return 0;
+	}
+	if( !pPalette_->pBlockStates )
+	{
+		memset( pBlocks_, pLookup_[ 0 ], BLOCKS_PER_SECTION );
+		return 1;
+	}
+	int bits = 4;
+	while( ( 1 << bits ) < pPalette_->paletteSize )
+	{
+		++bits;
+	}
+	// the layout is told apart by the array length, they agree when bits divides 64
+	int32_t straddlingLongs = ( BLOCKS_PER_SECTION * bits + 63 ) / 64;
+	int32_t perLong = 64 / bits;
+	int32_t alignedLongs = ( BLOCKS_PER_SECTION + perLong - 1 ) / perLong;
+	int straddling = pPalette_->numBlockStates == straddlingLongs;
+	if( !straddling && pPalette_->numBlockStates != alignedLongs )
+	{
+		return 0;
+	}
+	// indices past the palette map to air
+	uint8_t lut[ BLOCKS_PER_SECTION + 3 ];
+	memcpy( lut, pLookup_, ( size_t )pPalette_->paletteSize );
+	memset( lut + pPalette_->paletteSize, 0, ( size_t )( ( 1 << bits ) + 3 - pPalette_->paletteSize ) );
+#ifdef ENKI_MI_HAS_SSSE3_UNPACK
+	if( 4 == bits && __builtin_cpu_supports( "ssse3" ) )
+	{
+		Unpack4BitsSSSE3( pPalette_->pBlockStates, lut, pBlocks_ );
+		return 1;
+	}
+	if( straddling && 64 % bits && __builtin_cpu_supports( "avx2" ) )
+	{
+		UnpackStraddlingAVX2( pPalette_->pBlockStates, pPalette_->numBlockStates, bits, lut, pBlocks_ );
+		return 1;
+	}
+#endif
+	switch( bits )
+	{
+		UNPACK_WIDTH( 4 )
+		UNPACK_WIDTH( 5 )
+		UNPACK_WIDTH( 6 )
+		UNPACK_WIDTH( 7 )
+		UNPACK_WIDTH( 8 )
+		UNPACK_WIDTH( 9 )
+		UNPACK_WIDTH( 10 )
+		UNPACK_WIDTH( 11 )
+		UNPACK_WIDTH( 12 )
+	default:
+		return 0;
+	}
+	return 1;
+}
+
 enkiMICoordinate enkiGetChunkOrigin(enkiChunkBlockData * pChunk_)
 {
 	enkiMICoordinate retVal;
@@ -539,7 +1680,7 @@ enkiMICoordinate enkiGetChunkSectionOrigin(enkiChunkBlockData * pChunk_, int32_t
 {
 	enkiMICoordinate retVal;
 	retVal.x = pChunk_->xPos * ENKI_MI_SIZE_SECTIONS;
-	retVal.y = section_ * ENKI_MI_SIZE_SECTIONS;
+	retVal.y = ( section_ + ENKI_MI_MIN_SECTION_Y ) * ENKI_MI_SIZE_SECTIONS;
 	retVal.z = pChunk_->zPos * ENKI_MI_SIZE_SECTIONS;
 	return retVal;
 }
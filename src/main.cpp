@@ -22,8 +22,30 @@
 #include <enkimi.h>
 #include <miniz.h>
 #include <optional>
+#include <string_view>
+#include <unordered_map>
 #include <cmath>
 #include <filesystem>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef NANOVOXEL_HAS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 #include <mc.h>
 
 namespace fs = std::filesystem;
@@ -31,6 +53,7 @@ namespace fs = std::filesystem;
 using namespace glm;
 
 #define ENABLE_ATMOSPHERE_SCATTERING 0x1
+#define USE_TREE64 0x2 // trace the Tree64 instead of the octree
 
 void GLAPIENTRY MessageCallback(GLenum source, GLenum type, GLuint id,
                                 GLenum severity, GLsizei length,
@@ -47,26 +70,587 @@ void GLAPIENTRY MessageCallback(GLenum source, GLenum type, GLuint id,
 #include "../shaders/bsdf.h"
 #include "../shaders/common-defs.h"
 
+// Runs f(i) for i in [0, count) on all hardware threads. Work is handed out
+// dynamically, so uneven items (e.g. empty vs. full chunks) balance out.
+template <class F> void parallelFor(size_t count, F &&f) {
+    size_t nThreads = std::max(1u, std::thread::hardware_concurrency());
+    nThreads = std::min(nThreads, count);
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            f(i);
+        }
+    };
+    if (nThreads <= 1) {
+        worker();
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nThreads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : threads) {
+        t.join();
+    }
+}
+
+inline int countTrailingZeros(uint64_t x) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return (int)i;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+inline int countLeadingZeros(uint64_t x) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanReverse64(&i, x);
+    return 63 - (int)i;
+#else
+    return __builtin_clzll(x);
+#endif
+}
+
+inline int popCount(uint64_t x) {
+#ifdef _MSC_VER
+    return (int)__popcnt64(x);
+#else
+    return __builtin_popcountll(x);
+#endif
+}
+
+// Finds the first and last non-zero byte of a row, eight bytes at a time.
+// Returns false if the whole row is zero.
+inline bool rowExtent(const uint8_t *row, int n, int &first, int &last) {
+    first = -1;
+    for (int i = 0; i < n; i += 8) {
+        uint64_t word = 0;
+        int len = std::min(8, n - i);
+        memcpy(&word, row + i, len); // little endian: byte k is bits 8k..8k+7
+        if (word) {
+            if (first < 0) {
+                first = i + countTrailingZeros(word) / 8;
+            }
+            last = i + 7 - countLeadingZeros(word) / 8;
+        }
+    }
+    return first >= 0;
+}
+
 void setUpDockSpace();
-struct OctreeNode {
-    alignas(16) ivec3 pmin;
-    alignas(16) ivec3 pmax;
+// Node of the octree while it is being built
+struct OctreeBuildNode {
+    ivec3 pmin;
+    ivec3 pmax;
     std::array<int, 8> children = {-1, -1,-1, -1,-1, -1,-1, -1};
     bool isLeaf = false;
 };
+// Node as uploaded to the GPU, 24 bytes in std430. Bounds are 16 bit offsets
+// from the parent's pmin (the root's from the world origin). The children of
+// a node are stored contiguously from firstChild, one per set bit of the
+// child mask, in slot order. Leaves keep no children. Each node links back to
+// its parent and knows its slot there, for the traversal to find the next
+// sibling without a stack.
+struct OctreeNode {
+    static constexpr uint32_t childMaskBits = 0xffu;
+    static constexpr uint32_t leafFlag = 0x100u;
+    static constexpr int slotShift = 9;
+    static constexpr int maxExtent = 0xffff;
+    static constexpr size_t maxNodes = size_t(1) << 26;
+    uint32_t bounds[3] = {0, 0, 0}; // pmin.xy, pmin.z pmax.x, pmax.yz
+    uint32_t info = 0;              // child mask, leaf flag, slot in the parent
+    uint32_t firstChild = 0;
+    uint32_t parent = 0; // the root's is itself
+
+    ivec3 pmin(const ivec3 &parentMin) const {
+        return parentMin + ivec3(bounds[0] & 0xffff, bounds[0] >> 16,
+                                 bounds[1] & 0xffff);
+    }
+    ivec3 pmax(const ivec3 &parentMin) const {
+        return parentMin + ivec3(bounds[1] >> 16, bounds[2] & 0xffff,
+                                 bounds[2] >> 16);
+    }
+    void setBounds(const ivec3 &parentMin, const ivec3 &pmin,
+                   const ivec3 &pmax) {
+        ivec3 a = pmin - parentMin, b = pmax - parentMin;
+        if (glm::any(glm::lessThan(a, ivec3(0))) ||
+            glm::any(glm::greaterThan(b, ivec3(maxExtent)))) {
+            abort();
+        }
+        bounds[0] = uint32_t(a.x) | uint32_t(a.y) << 16;
+        bounds[1] = uint32_t(a.z) | uint32_t(b.x) << 16;
+        bounds[2] = uint32_t(b.y) | uint32_t(b.z) << 16;
+    }
+    bool isLeaf() const { return (info & leafFlag) != 0; }
+    uint32_t childMask() const { return info & childMaskBits; }
+    int slot() const { return (info >> slotShift) & 7; }
+};
+static_assert(sizeof(OctreeNode) == 24, "OctreeNode must match the std430 layout");
 struct Box3i {
     ivec3 pmin;
     ivec3 pmax;
     ivec3 size() const { return pmax - pmin; }
 };
+// Sparse two level voxel storage: a grid of brick references covering the
+// world, pointing into a pool of 8^3 bricks. Bricks of a single material
+// (including all air) are not stored, their reference holds the material.
+struct BrickMap {
+    static constexpr int brickWidth = 8;
+    static constexpr int brickVolume = brickWidth * brickWidth * brickWidth;
+    // references with this bit set are uniform bricks, the low byte being
+    // the material. Otherwise the reference is an index into the pool.
+    static constexpr uint32_t uniformBrick = 0x80000000u;
+    ivec3 dimension = ivec3(0);     // in voxels
+    ivec3 gridDimension = ivec3(0); // in bricks
+    std::vector<uint32_t> grid;
+    std::vector<uint8_t> pool; // bricks are x fastest, then y, then z
+    std::vector<uint32_t> freeBricks; // pool slots released by release()
+
+    BrickMap() = default;
+    explicit BrickMap(const ivec3 &dimension)
+        : dimension(dimension),
+          gridDimension((dimension + ivec3(brickWidth - 1)) / brickWidth) {
+        grid.assign(size_t(gridDimension.x) * gridDimension.y * gridDimension.z,
+                    uniformBrick);
+    }
+
+    size_t brickIndex(const ivec3 &brick) const {
+        return brick.x + size_t(gridDimension.x) *
+                             (brick.y + size_t(gridDimension.y) * brick.z);
+    }
+    static int voxelOffset(const ivec3 &local) {
+        return local.x + brickWidth * (local.y + brickWidth * local.z);
+    }
+    size_t brickCount() const { return pool.size() / brickVolume; }
+
+    // p must be inside the map
+    uint8_t get(const ivec3 &p) const {
+        uint32_t ref = grid[brickIndex(p / brickWidth)];
+        if (ref & uniformBrick) {
+            return uint8_t(ref);
+        }
+        return pool[size_t(ref) * brickVolume + voxelOffset(p % brickWidth)];
+    }
+
+    // storage of a brick, nullptr if it is uniform
+    uint8_t *brickData(const ivec3 &brick) {
+        uint32_t ref = grid[brickIndex(brick)];
+        return (ref & uniformBrick) ? nullptr
+                                    : &pool[size_t(ref) * brickVolume];
+    }
+
+    // Gives a brick its own storage, filled with its uniform material.
+    // Not thread safe, as the pool may grow.
+    uint8_t *allocate(const ivec3 &brick) {
+        auto &ref = grid[brickIndex(brick)];
+        if (ref & uniformBrick) {
+            auto material = uint8_t(ref);
+            if (freeBricks.empty()) {
+                ref = uint32_t(brickCount());
+                pool.resize(pool.size() + brickVolume, material);
+            } else {
+                ref = freeBricks.back();
+                freeBricks.pop_back();
+                memset(&pool[size_t(ref) * brickVolume], material, brickVolume);
+            }
+        }
+        return &pool[size_t(ref) * brickVolume];
+    }
+
+    // Turns a brick back into a uniform reference if all its voxels are the
+    // same, its slot is then reused by allocate. Returns true if it did.
+    bool release(const ivec3 &brick) {
+        auto &ref = grid[brickIndex(brick)];
+        if (ref & uniformBrick) {
+            return false;
+        }
+        uint8_t *data = &pool[size_t(ref) * brickVolume];
+        if (!std::all_of(data, data + brickVolume,
+                         [=](uint8_t v) { return v == data[0]; })) {
+            return false;
+        }
+        freeBricks.push_back(ref);
+        ref = uniformBrick | data[0];
+        return true;
+    }
+
+    void set(const ivec3 &p, uint8_t value) {
+        uint32_t ref = grid[brickIndex(p / brickWidth)];
+        if (ref == (uniformBrick | value)) {
+            return;
+        }
+        allocate(p / brickWidth)[voxelOffset(p % brickWidth)] = value;
+    }
+
+    // Turns bricks of a single material back into uniform references and
+    // closes the holes they leave in the pool.
+    void compact() {
+        size_t count = brickCount();
+        std::vector<uint32_t> uniform(count, 0);
+        parallelFor(count, [&](size_t i) {
+            const uint8_t *brick = &pool[i * brickVolume];
+            if (std::all_of(brick, brick + brickVolume,
+                            [=](uint8_t v) { return v == brick[0]; })) {
+                uniform[i] = uniformBrick | brick[0];
+            }
+        });
+        std::vector<uint32_t> remap(count);
+        size_t next = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (uniform[i]) {
+                continue;
+            }
+            if (next != i) {
+                memcpy(&pool[next * brickVolume], &pool[i * brickVolume],
+                       brickVolume);
+            }
+            remap[i] = uint32_t(next++);
+        }
+        pool.resize(next * brickVolume);
+        pool.shrink_to_fit();
+        freeBricks.clear();
+        for (auto &ref : grid) {
+            if (!(ref & uniformBrick)) {
+                ref = uniform[ref] ? uniform[ref] : remap[ref];
+            }
+        }
+    }
+};
+
+// Sparse voxel DAG of a brick map: a tree of 2x2x2 nodes down to leaves of
+// 2x2x2 voxels, over a power of two cube of bricks. Identical leaves and
+// identical subtrees, materials included, are stored once. References are
+// those of BrickMap: uniform references hold a material, the others index
+// leaves for the nodes of level 1 and nodes above. A node of level l spans
+// 2^(l+1) voxels, so bricks are the nodes of level 2.
+struct VoxelDag {
+    static constexpr int brickLevel = 2;
+    using Children = std::array<uint32_t, 8>; // x fastest
+    int levels = 0;
+    uint32_t root = BrickMap::uniformBrick;
+    std::vector<Children> nodes;
+    std::vector<uint64_t> leaves; // 8 voxels per leaf, x fastest
+
+    size_t bytes() const {
+        return nodes.size() * sizeof(Children) + leaves.size() * sizeof(uint64_t);
+    }
+
+    struct LeafHash {
+        size_t operator()(uint64_t key) const {
+            key = (key ^ (key >> 33)) * 0xff51afd7ed558ccdull;
+            return key ^ (key >> 33);
+        }
+    };
+    struct ChildrenHash {
+        size_t operator()(const Children &c) const {
+            return std::hash<std::string_view>()(
+                std::string_view((const char *)c.data(), sizeof(c)));
+        }
+    };
+
+    // Numbers the distinct keys that uniform(key, ref) does not turn into a
+    // uniform reference, appending them to unique. Keys are split into shards
+    // by hash, each shard is deduplicated in parallel with its own table.
+    template <class Key, class Hash, class Uniform>
+    static std::vector<uint32_t> deduplicate(const std::vector<Key> &keys,
+                                             Uniform &&uniform,
+                                             std::vector<Key> &unique) {
+        const size_t shardCount = 64;
+        std::vector<uint32_t> refs(keys.size());
+        std::vector<uint8_t> shardOf(keys.size());
+        parallelFor(keys.size(), [&](size_t i) {
+            shardOf[i] = uniform(keys[i], refs[i])
+                             ? uint8_t(shardCount)
+                             : uint8_t(Hash()(keys[i]) >> 58);
+        });
+        std::vector<std::vector<uint32_t>> shards(shardCount), firsts(shardCount);
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (shardOf[i] < shardCount) {
+                shards[shardOf[i]].push_back(uint32_t(i));
+            }
+        }
+        parallelFor(shardCount, [&](size_t s) {
+            std::unordered_map<Key, uint32_t, Hash> table;
+            for (auto i : shards[s]) {
+                auto it = table.emplace(keys[i], uint32_t(firsts[s].size()));
+                if (it.second) {
+                    firsts[s].push_back(i);
+                }
+                refs[i] = it.first->second;
+            }
+        });
+        std::vector<size_t> offsets(shardCount + 1, unique.size());
+        for (size_t s = 0; s < shardCount; s++) {
+            offsets[s + 1] = offsets[s] + firsts[s].size();
+        }
+        unique.resize(offsets[shardCount]);
+        parallelFor(shardCount, [&](size_t s) {
+            for (size_t j = 0; j < firsts[s].size(); j++) {
+                unique[offsets[s] + j] = keys[firsts[s][j]];
+            }
+            for (auto i : shards[s]) {
+                refs[i] += uint32_t(offsets[s]);
+            }
+        });
+        return refs;
+    }
+
+    // References to the nodes of one level. Nodes whose children are all the
+    // same uniform reference become that reference.
+    std::vector<uint32_t> addLevel(const std::vector<Children> &children) {
+        return deduplicate<Children, ChildrenHash>(
+            children,
+            [](const Children &c, uint32_t &ref) {
+                ref = c[0];
+                return (c[0] & BrickMap::uniformBrick) &&
+                       std::all_of(c.begin(), c.end(),
+                                   [&](uint32_t r) { return r == c[0]; });
+            },
+            nodes);
+    }
+
+    static VoxelDag build(const BrickMap &map) {
+        VoxelDag dag;
+        size_t count = map.brickCount();
+        // leaves of each stored brick, in the order of the nodes above them:
+        // the low 3 bits of i are the child index at level 1, the next 3 the
+        // one at level 2
+        std::vector<uint64_t> leafKeys(count * 64);
+        parallelFor(count, [&](size_t b) {
+            const uint8_t *brick = &map.pool[b * BrickMap::brickVolume];
+            for (int i = 0; i < 64; i++) {
+                ivec3 origin = ivec3(i & 1, (i >> 1) & 1, (i >> 2) & 1) * 2 +
+                               ivec3((i >> 3) & 1, (i >> 4) & 1, i >> 5) * 4;
+                uint64_t key = 0;
+                for (int v = 0; v < 8; v++) {
+                    ivec3 p = origin + ivec3(v & 1, (v >> 1) & 1, v >> 2);
+                    key |= uint64_t(brick[BrickMap::voxelOffset(p)]) << (8 * v);
+                }
+                leafKeys[b * 64 + i] = key;
+            }
+        });
+        auto leafRefs = deduplicate<uint64_t, LeafHash>(
+            leafKeys,
+            [](uint64_t key, uint32_t &ref) {
+                ref = BrickMap::uniformBrick | uint32_t(key & 0xff);
+                return key == (key & 0xff) * 0x0101010101010101ull;
+            },
+            dag.leaves);
+        leafKeys = std::vector<uint64_t>();
+        // refs holds the references of the current level, 8 consecutive ones
+        // are the children of a node until the bricks
+        std::vector<uint32_t> refs = std::move(leafRefs);
+        std::vector<Children> children;
+        for (int level = 1; level <= brickLevel; level++) {
+            children.resize(refs.size() / 8);
+            memcpy(children.data(), refs.data(), refs.size() * sizeof(uint32_t));
+            refs = dag.addLevel(children);
+        }
+        // then the brick grid, padded with air to even sizes at each level
+        ivec3 dimension = map.gridDimension;
+        std::vector<uint32_t> brickRefs = std::move(refs);
+        refs.resize(map.grid.size());
+        parallelFor(refs.size(), [&](size_t i) {
+            uint32_t ref = map.grid[i];
+            refs[i] = (ref & BrickMap::uniformBrick) ? ref : brickRefs[ref];
+        });
+        dag.levels = brickLevel;
+        while (glm::any(glm::greaterThan(dimension, ivec3(1)))) {
+            ivec3 parent = (dimension + ivec3(1)) / 2;
+            children.resize(size_t(parent.x) * parent.y * parent.z);
+            parallelFor(children.size(), [&](size_t i) {
+                ivec3 p(i % parent.x, i / parent.x % parent.y,
+                        i / (size_t(parent.x) * parent.y));
+                for (int c = 0; c < 8; c++) {
+                    ivec3 q = p * 2 + ivec3(c & 1, (c >> 1) & 1, c >> 2);
+                    children[i][c] =
+                        glm::all(glm::lessThan(q, dimension))
+                            ? refs[q.x + size_t(dimension.x) *
+                                             (q.y + size_t(dimension.y) * q.z)]
+                            : BrickMap::uniformBrick;
+                }
+            });
+            refs = dag.addLevel(children);
+            dimension = parent;
+            dag.levels++;
+        }
+        dag.root = refs.empty() ? BrickMap::uniformBrick : refs[0];
+        return dag;
+    }
+
+    // same as BrickMap::get for p inside the map
+    uint8_t get(const ivec3 &p) const {
+        uint32_t ref = root;
+        for (int level = levels; level > 0 && !(ref & BrickMap::uniformBrick); level--) {
+            ivec3 c = (p >> level) & 1;
+            ref = nodes[ref][c.x + 2 * c.y + 4 * c.z];
+        }
+        if (ref & BrickMap::uniformBrick) {
+            return uint8_t(ref);
+        }
+        ivec3 c = p & 1;
+        return uint8_t(leaves[ref] >> (8 * (c.x + 2 * c.y + 4 * c.z)));
+    }
+};
+
+// 64-tree of a brick map, an alternative to the octree: nodes of 4x4x4
+// cells with one occupancy bit per cell (x fastest), over a cube of 4^levels
+// voxels. A node of level l has cells of 4^(l-1) voxels, so the cells of
+// level 1 are voxels. The children of the occupied cells of a node are
+// stored contiguously from firstChild in bit order, nodes of level 1 keep
+// none. 12 bytes in std430.
+struct Tree64Node {
+    uint32_t mask[2] = {0, 0};
+    uint32_t firstChild = 0;
+
+    uint64_t occupancy() const { return mask[0] | uint64_t(mask[1]) << 32; }
+};
+static_assert(sizeof(Tree64Node) == 12, "Tree64Node must match the std430 layout");
+struct Tree64 {
+    int levels = 1;
+    std::vector<Tree64Node> nodes; // breadth first, the root first
+
+    static Tree64 build(const BrickMap &map) {
+        Tree64 tree;
+        while ((1 << (2 * tree.levels)) < compMax(map.dimension)) {
+            tree.levels++;
+        }
+        // occupancy of every node, level by level from the voxels up. Nodes
+        // of level 1 are half a brick wide.
+        std::vector<std::vector<uint64_t>> masks(tree.levels + 1);
+        std::vector<ivec3> dimensions(tree.levels + 1);
+        dimensions[1] = (map.dimension + ivec3(3)) / 4;
+        auto count = [](const ivec3 &d) { return size_t(d.x) * d.y * d.z; };
+        masks[1].resize(count(dimensions[1]));
+        parallelFor(masks[1].size(), [&](size_t i) {
+            const ivec3 &d = dimensions[1];
+            ivec3 p = ivec3(i % d.x, i / d.x % d.y, i / (size_t(d.x) * d.y)) * 4;
+            uint32_t ref = map.grid[map.brickIndex(p / BrickMap::brickWidth)];
+            if (ref == BrickMap::uniformBrick) {
+                return;
+            }
+            uint64_t mask = 0;
+            for (int c = 0; c < 64; c++) {
+                ivec3 v = p + ivec3(c & 3, (c >> 2) & 3, c >> 4);
+                if (glm::all(glm::lessThan(v, map.dimension)) &&
+                    ((ref & BrickMap::uniformBrick) ||
+                     map.pool[size_t(ref) * BrickMap::brickVolume +
+                              BrickMap::voxelOffset(v % BrickMap::brickWidth)])) {
+                    mask |= uint64_t(1) << c;
+                }
+            }
+            masks[1][i] = mask;
+        });
+        for (int level = 2; level <= tree.levels; level++) {
+            const ivec3 d = dimensions[level] = (dimensions[level - 1] + ivec3(3)) / 4;
+            const ivec3 below = dimensions[level - 1];
+            masks[level].resize(count(d));
+            parallelFor(masks[level].size(), [&](size_t i) {
+                ivec3 p = ivec3(i % d.x, i / d.x % d.y, i / (size_t(d.x) * d.y)) * 4;
+                uint64_t mask = 0;
+                for (int c = 0; c < 64; c++) {
+                    ivec3 q = p + ivec3(c & 3, (c >> 2) & 3, c >> 4);
+                    if (glm::all(glm::lessThan(q, below)) &&
+                        masks[level - 1][q.x + size_t(below.x) *
+                                                   (q.y + size_t(below.y) * q.z)]) {
+                        mask |= uint64_t(1) << c;
+                    }
+                }
+                masks[level][i] = mask;
+            });
+        }
+        // then the layout from the root down: the nodes of a level in the
+        // order of their parents' bits, each one's children placed by a
+        // prefix sum of the child counts
+        std::vector<ivec3> current{ivec3(0)};
+        for (int level = tree.levels; level >= 1; level--) {
+            const ivec3 &d = dimensions[level];
+            auto maskOf = [&](const ivec3 &p) {
+                return masks[level][p.x + size_t(d.x) * (p.y + size_t(d.y) * p.z)];
+            };
+            std::vector<uint32_t> offsets(current.size() + 1, 0);
+            for (size_t i = 0; i < current.size(); i++) {
+                offsets[i + 1] = offsets[i] +
+                                 (level > 1 ? popCount(maskOf(current[i])) : 0);
+            }
+            size_t first = tree.nodes.size();
+            size_t childBase = first + current.size();
+            if (childBase + offsets.back() >= (size_t(1) << 32)) {
+                fprintf(stderr, "64-tree too large\n");
+                abort();
+            }
+            tree.nodes.resize(childBase);
+            std::vector<ivec3> children(offsets.back());
+            parallelFor(current.size(), [&](size_t i) {
+                uint64_t mask = maskOf(current[i]);
+                auto &node = tree.nodes[first + i];
+                node.mask[0] = uint32_t(mask);
+                node.mask[1] = uint32_t(mask >> 32);
+                if (level == 1) {
+                    return;
+                }
+                node.firstChild = uint32_t(childBase + offsets[i]);
+                size_t k = offsets[i];
+                for (; mask; mask &= mask - 1) {
+                    int c = countTrailingZeros(mask);
+                    children[k++] =
+                        current[i] * 4 + ivec3(c & 3, (c >> 2) & 3, c >> 4);
+                }
+            });
+            current = std::move(children);
+        }
+        return tree;
+    }
+};
+
+// Blocks of a single decoded chunk. Only the sections present in the NBT are
+// kept, so the NBT stream can be freed as soon as the chunk has been decoded.
+struct DecodedChunk {
+    ivec2 position; // chunk coordinates
+    uint32_t sectionMask = 0; // bit i for section Y i + ENKI_MI_MIN_SECTION_Y
+    std::vector<uint8_t> blocks; // 4096 bytes (YZX) per bit set in sectionMask
+    // tight bound of non-air voxels in block coordinates, pmax inclusive
+    ivec3 pmin = ivec3(std::numeric_limits<int>::max());
+    ivec3 pmax = ivec3(std::numeric_limits<int>::min());
+    bool empty() const { return pmin.x > pmax.x; }
+};
+
 struct World {
-    std::vector<uint8_t> data;
-    ivec3 worldDimension, alignedDimension;
-    GLuint octreeBuffer;
-    GLuint world;
-    GLuint materialsSSBO;
+    BrickMap voxels;
+    ivec3 worldDimension;
+    ivec3 origin = ivec3(0); // block coordinate of voxel (0, 0, 0)
+    GLuint octreeBuffer = 0;
+    GLuint brickGridBuffer = 0;
+    GLuint brickPoolBuffer = 0;
+    GLuint occupancyBuffer = 0;
+    GLuint materialsSSBO = 0;
+    GLuint emptyDistanceTexture = 0;
+    GLuint tree64Buffer = 0;
     std::vector<OctreeNode> octree;
     int octreeRoot = -1;
+    // per pool brick, a bit per voxel that is not air (voxelOffset order).
+    // The leaf DDA tests these and reads the pool only on a hit.
+    static constexpr int occupancyWords = BrickMap::brickVolume / 32;
+    std::vector<uint32_t> occupancy;
+    // edits not uploaded yet: grid indices of the edited bricks and the first
+    // octree node that changed
+    std::vector<size_t> dirtyBricks;
+    size_t octreeUploadFrom = std::numeric_limits<size_t>::max();
+    // allocated sizes of the pool and octree buffers in bytes
+    size_t poolBufferSize = 0;
+    size_t octreeBufferSize = 0;
+    // upload a VoxelDag of the voxels instead of the brick map, the grid and
+    // pool buffers then hold its nodes and leaves
+    bool useDag = false;
+    uint32_t dagRoot = BrickMap::uniformBrick;
+    int dagLevels = 0;
+    // levels of the uploaded Tree64, 0 until a renderer asks for it. It is
+    // then kept up to date with the voxels.
+    int tree64Levels = 0;
     float sunHeight = 0.0f;
     float sunPhi = 0.0f;
     static const int octreeWidth = 8;
@@ -82,153 +666,400 @@ struct World {
     std::vector<std::string> materialNames;
 
     void loadMinecraftMaterials();
-    void buildOctree() {
-        // auto s = ivec3(glm::ceil(
-        //     glm::log(vec3(worldDimension) / vec3(octreeWidth)) / 3.0f));
-        // octree.reserve(s.x * s.y * s.z);
-        octreeRoot = buildOctree(Box3i{ivec3(0), worldDimension}, 0).value();
-        printf("%d octree nodes; root=%d\n", (int)octree.size(), octreeRoot);
-        auto box = Box3i{octree[octreeRoot].pmin, octree[octreeRoot].pmax};
-        printf("box %d %d %d to %d %d %d\n", box.pmin.x, box.pmin.y, box.pmin.z,
-               box.pmax.x, box.pmax.y, box.pmax.z);
+    // Tight bound of the non-air voxels of one octree leaf box
+    struct LeafBound {
+        ivec3 pmin = ivec3(std::numeric_limits<int>::max());
+        ivec3 pmax = ivec3(-std::numeric_limits<int>::max());
+        bool empty() const { return pmin.x > pmax.x; }
+    };
+
+    // Summed volume table of non-air bricks, lets the octree build reject
+    // empty boxes without visiting their leaves
+    std::vector<uint32_t> occupiedBricks;
+    void buildOccupiedBricks() {
+        const ivec3 n = voxels.gridDimension + ivec3(1);
+        occupiedBricks.assign(size_t(n.x) * n.y * n.z, 0);
+        auto at = [&](int x, int y, int z) -> uint32_t & {
+            return occupiedBricks[x + size_t(n.x) * (y + size_t(n.y) * z)];
+        };
+        for (int z = 1; z < n.z; z++) {
+            for (int y = 1; y < n.y; y++) {
+                for (int x = 1; x < n.x; x++) {
+                    uint32_t ref = voxels.grid[voxels.brickIndex(ivec3(x - 1, y - 1, z - 1))];
+                    uint32_t occupied = ref != BrickMap::uniformBrick;
+                    at(x, y, z) = occupied + at(x - 1, y, z) + at(x, y - 1, z) +
+                                  at(x, y, z - 1) - at(x - 1, y - 1, z) -
+                                  at(x - 1, y, z - 1) - at(x, y - 1, z - 1) +
+                                  at(x - 1, y - 1, z - 1);
+                }
+            }
+        }
     }
-    std::optional<int> buildOctree(Box3i box, int level) {
-        // if(level < 3)
-        // printf("building octree %d %d %d to %d %d %d\n", box.pmin.x,
-        // box.pmin.y, box.pmin.z , box.pmax.x, box.pmax.y, box.pmax.z);
-        // printf("%d\n",level);
-        // printf("= box %d %d %d to %d %d %d\n", box.pmin.x, box.pmin.y,
-            //    box.pmin.z, box.pmax.x, box.pmax.y, box.pmax.z);
-        if (glm::all(glm::lessThanEqual(box.size(), ivec3(octreeWidth)))) {
-            // count how many ?
-            size_t count = 0;
-            ivec3 pmin = ivec3(std::numeric_limits<int>::max());
-            ivec3 pmax = ivec3(-std::numeric_limits<int>::max());
-            for (int z = box.pmin.z; z < box.pmax.z; z++) {
-                for (int y = box.pmin.y; y < box.pmax.y; y++) {
-                    for (int x = box.pmin.x; x < box.pmax.x; x++) {
-                        if ((*this)(x, y, z) > 0) {
-                            pmin = min(pmin, ivec3(x, y, z));
-                            pmax = max(pmax, ivec3(x, y, z));
-                            count++;
-                        }
+    bool hasOccupiedBricks(const Box3i &box) const {
+        const ivec3 n = voxels.gridDimension + ivec3(1);
+        auto at = [&](int x, int y, int z) {
+            return occupiedBricks[x + size_t(n.x) * (y + size_t(n.y) * z)];
+        };
+        ivec3 a = box.pmin / BrickMap::brickWidth;
+        ivec3 b = (box.pmax - ivec3(1)) / BrickMap::brickWidth + ivec3(1);
+        return at(b.x, b.y, b.z) - at(a.x, b.y, b.z) - at(b.x, a.y, b.z) -
+                   at(b.x, b.y, a.z) + at(a.x, a.y, b.z) + at(a.x, b.y, a.z) +
+                   at(b.x, a.y, a.z) - at(a.x, a.y, a.z) !=
+               0;
+    }
+
+    // Calls f(childBox, childSlot) for the children of an inner octree box.
+    // Children that cannot hold voxels (empty extent or only air bricks)
+    // are skipped, they would reduce to no node.
+    template <class F> void forEachChildBox(const Box3i &box, F &&f) const {
+        auto step = glm::max(ivec3(1), (box.size() / 2) + ivec3(1));
+        for (int dx = 0; dx < 2; dx++) {
+            for (int dy = 0; dy < 2; dy++) {
+                for (int dz = 0; dz < 2; dz++) {
+                    ivec3 _pmin = box.pmin + step * ivec3(dx, dy, dz);
+                    ivec3 _pmax = glm::min(box.pmax, _pmin + step);
+                    Box3i child{_pmin, _pmax};
+                    if (glm::any(glm::lessThanEqual(_pmax, _pmin)) ||
+                        !hasOccupiedBricks(child)) {
+                        continue;
                     }
+                    f(child, dz * 4 + dy * 2 + dx);
                 }
             }
-            if (count == 0) {
-                return std::nullopt;
+        }
+    }
+    static bool isLeafBox(const Box3i &box) {
+        return glm::all(glm::lessThanEqual(box.size(), ivec3(octreeWidth)));
+    }
+
+    // Finds the first and last non-air voxel of the row [x0, x1) at (y, z),
+    // a brick row at a time: one 64 bit load for stored bricks, nothing for
+    // uniform ones.
+    bool scanRow(int y, int z, int x0, int x1, int &first,
+                   int &last) const {
+        const int width = BrickMap::brickWidth;
+        first = -1;
+        for (int x = x0; x < x1;) {
+            ivec3 p(x, y, z);
+            int len = std::min(x1 - x, width - x % width);
+            uint32_t ref = voxels.grid[voxels.brickIndex(p / width)];
+            int f = 0, l = len - 1;
+            bool hit;
+            if (ref & BrickMap::uniformBrick) {
+                hit = uint8_t(ref) != 0;
+            } else {
+                hit = ::rowExtent(&voxels.pool[size_t(ref) * BrickMap::brickVolume +
+                                               BrickMap::voxelOffset(p % width)],
+                                  len, f, l);
+            }
+            if (hit) {
+                if (first < 0) {
+                    first = x + f;
+                }
+                last = x + l;
             }
+            x += len;
+        }
+        return first >= 0;
+    }
 
-            OctreeNode node;
+    LeafBound scanLeaf(const Box3i &box) const {
+        LeafBound bound;
+        for (int z = box.pmin.z; z < box.pmax.z; z++) {
+            for (int y = box.pmin.y; y < box.pmax.y; y++) {
+                int first, last;
+                if (scanRow(y, z, box.pmin.x, box.pmax.x, first, last)) {
+                    bound.pmin = min(bound.pmin, ivec3(first, y, z));
+                    bound.pmax = max(bound.pmax, ivec3(last, y, z));
+                }
+            }
+        }
+        return bound;
+    }
 
-            node.pmax = glm::min(box.pmax, pmax + ivec3(1));
-            node.pmin = glm::max(box.pmin, pmin);
-            auto box3 = Box3i{node.pmin, node.pmax};
-            // printf("-> box %d %d %d to %d %d %d\n", box3.pmin.x, box3.pmin.y,
-                //    box3.pmin.z, box3.pmax.x, box3.pmax.y, box3.pmax.z);
-            // node.pmax = box.pmax;
-            // node.pmin = box.pmax;
-            node.isLeaf = true;
-            int nodeIndex = (int)octree.size();
-            octree.push_back(node);
+    // Subtrees at octreeCacheLevel are kept after a build. A subtree whose
+    // box does not intersect an edit comes out of the build unchanged, so
+    // updateOctree only redoes the subtrees that intersect the edited boxes.
+    static const int octreeCacheLevel = 4;
+    struct CachedSubtree {
+        std::vector<OctreeBuildNode> nodes; // indices relative to nodes[0]
+        int root = -1;                      // relative, -1 for no voxels
+    };
+    std::unordered_map<uint64_t, CachedSubtree> octreeCache;
+    std::vector<Box3i> octreeEdits;
 
-            return nodeIndex;
+    static uint64_t subtreeKey(const Box3i &box) {
+        return uint64_t(box.pmin.x) | uint64_t(box.pmin.y) << 21 |
+               uint64_t(box.pmin.z) << 42;
+    }
+    const CachedSubtree *cachedSubtree(const Box3i &box, int level) const {
+        if (level != octreeCacheLevel) {
+            return nullptr;
         }
-        OctreeNode node;
-        ivec3 pmin = ivec3(std::numeric_limits<int>::max());
-        ivec3 pmax = ivec3(-std::numeric_limits<int>::max());
+        for (const auto &edit : octreeEdits) {
+            if (all(lessThan(box.pmin, edit.pmax)) &&
+                all(lessThan(edit.pmin, box.pmax))) {
+                return nullptr;
+            }
+        }
+        auto it = octreeCache.find(subtreeKey(box));
+        return it == octreeCache.end() ? nullptr : &it->second;
+    }
+
+    void buildOctree() { updateOctree({Box3i{ivec3(0), worldDimension}}); }
+
+    // A box of the octree build in the list of its level. The children of
+    // an inner box are contiguous in the list of the next level.
+    struct OctreeBuildBox {
+        Box3i box;
+        int slot = 0; // in the parent
+        int firstChild = 0;
         int childCount = 0;
-        auto step = glm::max(ivec3(1), (box.size() / 2) + ivec3(1));
+        int leaf = -1; // its LeafBound, for leaf boxes
+        const CachedSubtree *cached = nullptr;
+        int node = -1; // once reduced, -1 for no voxels
+    };
 
-        for (int dx = 0; dx < 2; dx++) {
-            for (int dy = 0; dy < 2; dy++) {
-                for (int dz = 0; dz < 2; dz++) {
-                    ivec3 _pmin = box.pmin + step * ivec3(dx, dy, dz);
-                    ivec3 _pmax = glm::min(box.pmax, _pmin + step);
-                    if (glm::all(glm::equal(_pmin, _pmax))) {
-                        continue;
+    // Rebuilds the octree after the voxels inside edits changed. The boxes
+    // are listed level by level from the root, the leaves among them are
+    // scanned, and the levels are then reduced to nodes from the deepest one
+    // up. Each box owns a slot of the node array, so the boxes of a level are
+    // reduced in parallel; the slots of boxes that give no node are left
+    // unreachable. The tree is the one the recursive build gave.
+    void updateOctree(const std::vector<Box3i> &edits) {
+        octreeEdits = edits;
+        buildOccupiedBricks();
+        std::vector<std::vector<OctreeBuildBox>> levels(1);
+        levels[0].push_back({Box3i{ivec3(0), worldDimension}});
+        std::vector<Box3i> leafBoxes;
+        listOctreeBoxes(levels, leafBoxes);
+        std::vector<LeafBound> leaves(leafBoxes.size());
+        parallelFor(leafBoxes.size(),
+                    [&](size_t i) { leaves[i] = scanLeaf(leafBoxes[i]); });
+        std::vector<OctreeBuildNode> nodes;
+        std::unordered_map<uint64_t, CachedSubtree> cache;
+        int root = reduceOctreeBoxes(levels, leaves, nodes, cache);
+        octreeCache = std::move(cache);
+        octreeEdits.clear();
+        occupiedBricks = std::vector<uint32_t>();
+        auto previous = std::move(octree);
+        compactOctree(nodes, root);
+        octreeRoot = 0;
+        size_t same = 0;
+        while (same < std::min(previous.size(), octree.size()) &&
+               !memcmp(&previous[same], &octree[same], sizeof(OctreeNode))) {
+            same++;
+        }
+        octreeUploadFrom = std::min(octreeUploadFrom, same);
+        printf("%d octree nodes; root=%d (%zu leaves rebuilt)\n",
+               (int)octree.size(), octreeRoot, leafBoxes.size());
+        auto box = Box3i{nodes[root].pmin, nodes[root].pmax};
+        printf("box %d %d %d to %d %d %d\n", box.pmin.x, box.pmin.y, box.pmin.z,
+               box.pmax.x, box.pmax.y, box.pmax.z);
+    }
+
+    // Lists the boxes below levels[0], a level at a time. Leaf boxes and the
+    // boxes of cached subtrees end their branch.
+    void listOctreeBoxes(std::vector<std::vector<OctreeBuildBox>> &levels,
+                         std::vector<Box3i> &leafBoxes) const {
+        for (int level = 0; !levels[level].empty(); level++) {
+            auto &boxes = levels[level];
+            parallelFor(boxes.size(), [&](size_t i) {
+                auto &box = boxes[i];
+                box.cached = cachedSubtree(box.box, level);
+                if (!box.cached && !isLeafBox(box.box)) {
+                    forEachChildBox(box.box,
+                                    [&](const Box3i &, int) { box.childCount++; });
+                }
+            });
+            size_t childCount = 0;
+            for (auto &box : boxes) {
+                box.firstChild = int(childCount);
+                childCount += box.childCount;
+                if (!box.cached && isLeafBox(box.box)) {
+                    box.leaf = int(leafBoxes.size());
+                    leafBoxes.push_back(box.box);
+                }
+            }
+            std::vector<OctreeBuildBox> next(childCount);
+            parallelFor(boxes.size(), [&](size_t i) {
+                int child = boxes[i].firstChild;
+                if (boxes[i].childCount > 0) {
+                    forEachChildBox(boxes[i].box, [&](const Box3i &childBox, int slot) {
+                        next[child].box = childBox;
+                        next[child].slot = slot;
+                        child++;
+                    });
+                }
+            });
+            levels.push_back(std::move(next));
+        }
+        levels.pop_back();
+    }
+
+    // Reduces the listed boxes to nodes from the deepest level up and returns
+    // the root. The subtrees at octreeCacheLevel are kept in cache.
+    int reduceOctreeBoxes(std::vector<std::vector<OctreeBuildBox>> &levels,
+                          const std::vector<LeafBound> &leaves,
+                          std::vector<OctreeBuildNode> &nodes,
+                          std::unordered_map<uint64_t, CachedSubtree> &cache) const {
+        // a slot per box, then the nodes of the cached subtrees
+        std::vector<size_t> levelStart;
+        size_t nodeCount = 0;
+        for (auto &boxes : levels) {
+            levelStart.push_back(nodeCount);
+            nodeCount += boxes.size();
+        }
+        std::vector<size_t> cachedStart;
+        if (int(levels.size()) > octreeCacheLevel) {
+            for (auto &box : levels[octreeCacheLevel]) {
+                cachedStart.push_back(nodeCount);
+                nodeCount += box.cached ? box.cached->nodes.size() : 0;
+            }
+        }
+        nodes.assign(nodeCount, OctreeBuildNode{});
+        for (int level = int(levels.size()) - 1; level >= 0; level--) {
+            auto &boxes = levels[level];
+            parallelFor(boxes.size(), [&](size_t i) {
+                auto &box = boxes[i];
+                if (box.cached) {
+                    int start = int(cachedStart[i]);
+                    for (size_t j = 0; j < box.cached->nodes.size(); j++) {
+                        auto node = box.cached->nodes[j];
+                        for (auto &child : node.children) {
+                            child = child >= 0 ? child + start : child;
+                        }
+                        nodes[start + j] = node;
                     }
-                    auto child = buildOctree(Box3i{_pmin, _pmax}, level + 1);
-
-                    if (child.has_value()) {
-                        if(*child < 0)
-                            abort();
-                        auto box2 = Box3i{_pmin, _pmax};
-                        pmin = min(pmin, octree.at(child.value()).pmin);
-                        pmax = max(pmax, octree.at(child.value()).pmax);
-                        auto box3 = Box3i{pmin, pmax};
-                        Box3i target{ivec3(0, 0, 135), ivec3(68, 16, 203)};
-                        // if (glm::all(glm::equal(target.pmin, box.pmin)) &&
-                        //     glm::all(glm::equal(target.pmax, box.pmax))) {
-                        //     printf("box %d %d %d to %d %d %d\n", box.pmin.x,
-                        //            box.pmin.y, box.pmin.z, box.pmax.x,
-                        //            box.pmax.y, box.pmax.z);
-                        //     printf("box2 %d %d %d to %d %d %d\n", box2.pmin.x,
-                        //            box2.pmin.y, box2.pmin.z, box2.pmax.x,
-                        //            box2.pmax.y, box2.pmax.z);
-                        //     printf("box3 %d %d %d to %d %d %d\n", box3.pmin.x,
-                        //            box3.pmin.y, box3.pmin.z, box3.pmax.x,
-                        //            box3.pmax.y, box3.pmax.z);
-                        // }
-
-                        childCount++;
-                        node.children[dz * 4 + dy * 2 + dx] = *child;
+                    box.node = box.cached->root >= 0 ? box.cached->root + start : -1;
+                    return;
+                }
+                const OctreeBuildBox *children =
+                    box.childCount > 0 ? &levels[level + 1][box.firstChild] : nullptr;
+                box.node = reduceOctreeBox(box, children, level, leaves, nodes,
+                                           int(levelStart[level] + i));
+            });
+            if (level == octreeCacheLevel) {
+                std::vector<CachedSubtree> subtrees(boxes.size());
+                parallelFor(boxes.size(), [&](size_t i) {
+                    if (boxes[i].cached) {
+                        subtrees[i] = *boxes[i].cached;
+                    } else if (boxes[i].node >= 0) {
+                        // copied breadth first, indices relative to nodes[0]
+                        auto &subtree = subtrees[i];
+                        subtree.root = 0;
+                        subtree.nodes.push_back(nodes[boxes[i].node]);
+                        for (size_t j = 0; j < subtree.nodes.size(); j++) {
+                            auto children = subtree.nodes[j].children;
+                            for (int slot = 0; slot < 8; slot++) {
+                                if (children[slot] >= 0) {
+                                    subtree.nodes[j].children[slot] =
+                                        int(subtree.nodes.size());
+                                    subtree.nodes.push_back(nodes[children[slot]]);
+                                }
+                            }
+                        }
                     }
+                });
+                for (size_t i = 0; i < boxes.size(); i++) {
+                    cache[subtreeKey(boxes[i].box)] = std::move(subtrees[i]);
                 }
             }
         }
-        if (childCount > 0 && glm::any(glm::greaterThan(Box3i{pmin, pmax}.size(), box.size()))) {
-            // printf("box %d %d %d to %d %d %d\n", box.pmin.x, box.pmin.y,
-            //        box.pmin.z, box.pmax.x, box.pmax.y, box.pmax.z);
-            // printf("box2 %d %d %d to %d %d %d\n", pmin.x, pmin.y, pmin.z,
-            //        pmax.x, pmax.y, pmax.z);
-            // for (int i = 0; i < 8; i++) {
-            //     if (node.children[i] >= 0) {
-            //         auto _pmin = octree[node.children[i]].pmin;
-            //         auto _pmax = octree[node.children[i]].pmax;
-            //         printf("box %d %d %d to %d %d %d\n", _pmin.x, _pmin.y,
-            //                _pmin.z, _pmax.x, _pmax.y, _pmax.z);
-            //     }
-            // }
-            abort();
-        } else {
-            node.pmin = pmin;
-            node.pmax = pmax;
+        return levels[0][0].node;
+    }
+
+    // The node of one box from the nodes of its children: the box's own
+    // node, the only child's, or -1 when no child holds voxels
+    int reduceOctreeBox(const OctreeBuildBox &box, const OctreeBuildBox *children,
+                        int level, const std::vector<LeafBound> &leaves,
+                        std::vector<OctreeBuildNode> &nodes, int nodeIndex) const {
+        OctreeBuildNode node;
+        if (box.leaf >= 0) {
+            const auto &bound = leaves[box.leaf];
+            if (bound.empty()) {
+                return level == 0 ? emptyRoot(nodes, nodeIndex) : -1;
+            }
+            node.pmax = glm::min(box.box.pmax, bound.pmax + ivec3(1));
+            node.pmin = glm::max(box.box.pmin, bound.pmin);
+            node.isLeaf = true;
+            nodes[nodeIndex] = node;
+            return nodeIndex;
         }
-        if (childCount == 0) {
-            if (level == 0) {
-                node.pmin = vec3(0);
-                node.pmax = worldDimension;
-                node.isLeaf = true;
-                int nodeIndex = (int)octree.size();
-                octree.push_back(node);
-                return nodeIndex;
+        ivec3 pmin = ivec3(std::numeric_limits<int>::max());
+        ivec3 pmax = ivec3(-std::numeric_limits<int>::max());
+        int childCount = 0, onlyChild = -1;
+        for (int i = 0; i < box.childCount; i++) {
+            int child = children[i].node;
+            if (child >= 0) {
+                pmin = min(pmin, nodes[child].pmin);
+                pmax = max(pmax, nodes[child].pmax);
+                childCount++;
+                node.children[children[i].slot] = child;
+                onlyChild = child;
             }
-            return std::nullopt;
+        }
+        if (childCount == 0) {
+            return level == 0 ? emptyRoot(nodes, nodeIndex) : -1;
         } else if (childCount == 1) {
-            for (auto i : node.children) {
-                if (i >= 0) {
-                    // auto node = octree[i];
-                    // auto box3 = Box3i{node.pmin, node.pmax};
-                    // printf("-> box %d %d %d to %d %d %d\n", box3.pmin.x,
-                    //        box3.pmin.y, box3.pmin.z, box3.pmax.x, box3.pmax.y,
-                    //        box3.pmax.z);
-                    return i;
-                }
+            return onlyChild;
+        }
+        if (glm::any(glm::greaterThan(Box3i{pmin, pmax}.size(), box.box.size()))) {
+            abort();
+        }
+        node.pmin = pmin;
+        node.pmax = pmax;
+        if (glm::all(glm::lessThanEqual(Box3i{pmin, pmax}.size(), ivec3(64))) &&
+            childCount >= 5) {
+            // the traversal never enters a leaf, its subtree is left unreachable
+            node.isLeaf = true;
+            node.children.fill(-1);
+        }
+        nodes[nodeIndex] = node;
+        return nodeIndex;
+    }
+    // a world without voxels is a single leaf
+    int emptyRoot(std::vector<OctreeBuildNode> &nodes, int nodeIndex) const {
+        OctreeBuildNode node;
+        node.pmin = ivec3(0);
+        node.pmax = worldDimension;
+        node.isLeaf = true;
+        nodes[nodeIndex] = node;
+        return nodeIndex;
+    }
+    // Lays the built tree out breadth first in the compact GPU format, so
+    // that siblings are contiguous and the root is node 0
+    void compactOctree(const std::vector<OctreeBuildNode> &nodes, int root) {
+        struct Pending {
+            int node;
+            ivec3 parentMin;
+            uint32_t parent;
+            int slot;
+        };
+        std::vector<Pending> queue{{root, ivec3(0), 0, 0}};
+        octree.assign(1, OctreeNode{});
+        for (size_t i = 0; i < queue.size(); i++) {
+            const auto &src = nodes[queue[i].node];
+            auto &dst = octree[i];
+            dst.setBounds(queue[i].parentMin, src.pmin, src.pmax);
+            dst.parent = queue[i].parent;
+            dst.info = uint32_t(queue[i].slot) << OctreeNode::slotShift;
+            if (src.isLeaf) {
+                dst.info |= OctreeNode::leafFlag;
+                continue;
             }
-        } else {
-            Box3i box{pmin, pmax};
-            if (glm::all(glm::lessThanEqual(box.size(), ivec3(64)))) {
-                if (childCount >= 5) {
-                    node.isLeaf = true;
+            dst.firstChild = (uint32_t)queue.size();
+            for (int slot = 0; slot < 8; slot++) {
+                if (src.children[slot] >= 0) {
+                    dst.info |= 1u << slot;
+                    queue.push_back(
+                        {src.children[slot], src.pmin, uint32_t(i), slot});
                 }
             }
-            // auto box3 = Box3i{node.pmin, node.pmax};
-            // printf("-> box %d %d %d to %d %d %d\n", box3.pmin.x, box3.pmin.y,
-            //        box3.pmin.z, box3.pmax.x, box3.pmax.y, box3.pmax.z);
-            int nodeIndex = (int)octree.size();
-            octree.push_back(node);
-            return nodeIndex;
+            octree.resize(queue.size());
+        }
+        if (octree.size() > OctreeNode::maxNodes) {
+            abort();
         }
     }
     void initData() {
@@ -257,238 +1088,1126 @@ struct World {
             os << "Material " << i;
             materialNames[i] = os.str();
         }
+    }
+    // GL objects are only created once the world is uploaded, the CPU
+    // renderer runs without a context
+    void createBuffers() {
         glGenBuffers(1, &materialsSSBO);
         glBindBuffer(GL_SHADER_STORAGE_BUFFER, materialsSSBO);
         glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(Materials), NULL,
                      GL_DYNAMIC_COPY);
         glGenBuffers(1, &octreeBuffer);
+        glGenBuffers(1, &brickGridBuffer);
+        glGenBuffers(1, &brickPoolBuffer);
+        glGenBuffers(1, &occupancyBuffer);
+        glGenTextures(1, &emptyDistanceTexture);
+        glGenBuffers(1, &tree64Buffer);
+    }
+
+    // Exits if the octree cannot hold a world this large, its bounds being
+    // 16 bit offsets from the world origin down. Checked before the brick
+    // grid of the world is allocated.
+    static const ivec3 &checkedDimension(const ivec3 &worldDimension) {
+        if (any(greaterThan(worldDimension, ivec3(OctreeNode::maxExtent)))) {
+            fprintf(stderr,
+                    "a world of %d x %d x %d blocks is too large, at most %d "
+                    "blocks per axis are supported; load a part of it with --aabb\n",
+                    worldDimension.x, worldDimension.y, worldDimension.z,
+                    OctreeNode::maxExtent);
+            exit(1);
+        }
+        return worldDimension;
     }
 
     explicit World(const ivec3 &worldDimension)
-        : worldDimension(worldDimension),materials (new Materials()) {
+        : voxels(checkedDimension(worldDimension)),
+          worldDimension(worldDimension), materials(new Materials()) {
         materialNames.resize(MATERIAL_COUNT);
-        alignedDimension = worldDimension;
-        alignedDimension.x = (alignedDimension.x + 7U) & (-4U);
-        data.resize(
-            alignedDimension.x * alignedDimension.y * alignedDimension.z, 0);
         initData();
     }
 
-    uint8_t &operator()(int x, int y, int z) {
+    uint8_t operator()(int x, int y, int z) const {
         x = std::clamp<int>(x, 0, worldDimension.x - 1);
         y = std::clamp<int>(y, 0, worldDimension.y - 1);
         z = std::clamp<int>(z, 0, worldDimension.z - 1);
 
-        return data.at(x + alignedDimension.x * (y + z * alignedDimension.y));
+        return voxels.get(ivec3(x, y, z));
     }
 
-    uint8_t &operator()(const ivec3 &x) { return (*this)(x.x, x.y, x.z); }
+    uint8_t operator()(const ivec3 &x) const { return (*this)(x.x, x.y, x.z); }
 
-    void setUpTexture() {
-        glGenTextures(1, &world);
-        glBindTexture(GL_TEXTURE_3D, world);
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-        glTexImage3D(GL_TEXTURE_3D, 0, GL_RED, alignedDimension.x,
-                     alignedDimension.y, alignedDimension.z, 0, GL_RED,
-                     GL_UNSIGNED_BYTE, data.data());
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, octreeBuffer);
-        glBufferData(GL_SHADER_STORAGE_BUFFER,
-                     sizeof(OctreeNode) * octree.size(), octree.data(),
-                     GL_DYNAMIC_COPY);
+    void set(const ivec3 &p, uint8_t value) {
+        if (all(greaterThanEqual(p, ivec3(0))) &&
+            all(lessThan(p, worldDimension))) {
+            voxels.set(p, value);
+        }
     }
-};
 
-std::optional<std::pair<ivec3, ivec3>>
-getWorldBound(const std::vector<std::string> &filenames) {
-    // open the region file
-    ivec3 worldMin(std::numeric_limits<int>::max()),
-        worldMax(std::numeric_limits<int>::min());
-    for (const auto &filename : filenames) {
-        FILE *fp = fopen(filename.c_str(), "rb");
-        if (!fp) {
-            printf("failed to open file\n");
-            return {};
+    // Gives storage to every brick that receives a non-air voxel from a
+    // 16x16x16 YZX section whose minimum corner is at origin (in voxels, may
+    // be partially outside the world). Not thread safe, run it for all
+    // sections before importing them in parallel.
+    void allocateSection(const ivec3 &origin, const uint8_t *blocks) {
+        const int size = ENKI_MI_SIZE_SECTIONS;
+        for (int y = 0; y < size; y++) {
+            for (int z = 0; z < size; z++) {
+                int first, last;
+                if (!rowExtent(blocks + (y * size + z) * size, size, first,
+                               last)) {
+                    continue;
+                }
+                auto p0 = max(origin + ivec3(first, y, z), ivec3(0));
+                auto p1 = min(origin + ivec3(last, y, z), worldDimension - 1);
+                if (any(greaterThan(p0, p1))) {
+                    continue;
+                }
+                for (int x = p0.x / BrickMap::brickWidth;
+                     x <= p1.x / BrickMap::brickWidth; x++) {
+                    voxels.allocate(ivec3(x, p0.y / BrickMap::brickWidth,
+                                          p0.z / BrickMap::brickWidth));
+                }
+            }
         }
+    }
 
-        // output file
-        FILE *fpOutput = stdout; // fopen("output.txt", "w");
-        if (!fpOutput) {
-            printf("failed to open output file\n");
-            return {};
-            ;
+    // Copies a section prepared by allocateSection. Each (y, z) row is
+    // contiguous in x in both layouts, so rows are copied with memcpy, split
+    // at brick boundaries. Sections touching the same bricks write disjoint
+    // bytes, so this can run concurrently.
+    void importSection(const ivec3 &origin, const uint8_t *blocks) {
+        const int size = ENKI_MI_SIZE_SECTIONS;
+        const int width = BrickMap::brickWidth;
+        ivec3 lo = max(ivec3(0), -origin);
+        ivec3 hi = min(ivec3(size), worldDimension - origin);
+        if (any(lessThanEqual(hi, lo))) {
+            return;
         }
-
-        enkiRegionFile regionFile = enkiRegionFileLoad(fp);
-
-        for (int i = 0; i < ENKI_MI_REGION_CHUNKS_NUMBER; i++) {
-            enkiNBTDataStream stream;
-            enkiInitNBTDataStreamForChunk(regionFile, i, &stream);
-            if (stream.dataLength) {
-                enkiChunkBlockData aChunk = enkiNBTReadChunk(&stream);
-                enkiMICoordinate chunkOriginPos =
-                    enkiGetChunkOrigin(&aChunk); // y always 0
-                ivec3 chunkPos =
-                    ivec3(chunkOriginPos.x, chunkOriginPos.y, chunkOriginPos.z);
-
-                //            fprintf(fpOutput, "Chunk at xyz{ %d, %d, %d }
-                //            Number of sections: %d \n", chunkOriginPos.x,
-                //                    chunkOriginPos.y, chunkOriginPos.z,
-                //                    aChunk.countOfSections);
-
-                // iterate through chunk and count non 0 voxels as a demo
-                int64_t numVoxels = 0;
-                for (int section = 0; section < ENKI_MI_NUM_SECTIONS_PER_CHUNK;
-                     ++section) {
-                    if (aChunk.sections[section]) {
-                        enkiMICoordinate sectionOrigin =
-                            enkiGetChunkSectionOrigin(&aChunk, section);
-
-                        enkiMICoordinate sPos;
-                        // note order x then z then y iteration for cache
-                        // efficiency
-                        for (sPos.y = 0;
-                             sPos.y < ENKI_MI_NUM_SECTIONS_PER_CHUNK;
-                             ++sPos.y) {
-                            for (sPos.z = 0;
-                                 sPos.z < ENKI_MI_NUM_SECTIONS_PER_CHUNK;
-                                 ++sPos.z) {
-                                for (sPos.x = 0;
-                                     sPos.x < ENKI_MI_NUM_SECTIONS_PER_CHUNK;
-                                     ++sPos.x) {
-                                    uint8_t voxel = enkiGetChunkSectionVoxel(
-                                        &aChunk, section, sPos);
-
-                                    if (voxel) {
-                                        auto p = ivec3(sPos.x, sPos.y, sPos.z) +
-                                                 ivec3(sectionOrigin.x,
-                                                       sectionOrigin.y,
-                                                       sectionOrigin.z);
-                                        worldMin = min(worldMin, p);
-                                        worldMax = max(worldMax, p);
-                                        ++numVoxels;
-                                    }
-                                }
-                            }
-                        }
+        for (int y = lo.y; y < hi.y; y++) {
+            for (int z = lo.z; z < hi.z; z++) {
+                const uint8_t *row = blocks + (y * size + z) * size;
+                for (int x = lo.x; x < hi.x;) {
+                    auto p = origin + ivec3(x, y, z);
+                    int len = std::min(hi.x - x, width - p.x % width);
+                    // bricks left uniform only receive air
+                    if (auto brick = voxels.brickData(p / width)) {
+                        memcpy(brick + BrickMap::voxelOffset(p % width),
+                               row + x, len);
                     }
+                    x += len;
                 }
-                // fprintf(fpOutput, "   Chunk has %g non zero voxels\n",
-                // (float) numVoxels);
-
-                enkiNBTRewind(&stream);
-                // PrintStreamStructureToFile(&stream, fpOutput);
             }
-            enkiNBTFreeAllocations(&stream);
         }
-
-        enkiRegionFileFreeAllocations(&regionFile);
-
-        printf("%d %d %d  to %d %d %d\n", worldMin.x, worldMin.y, worldMin.z,
-               worldMax.x, worldMax.y, worldMax.z);
-        fclose(fp);
     }
-    return std::make_pair(worldMin, worldMax);
-}
 
-std::shared_ptr<World> McLoader(const std::vector<std::string> &filenames) {
-    auto bound = getWorldBound(filenames);
-    if (!bound) {
-        return nullptr;
-    }
-    auto worldMin = bound.value().first;
-    auto worldMax = bound.value().second;
-    auto world = std::make_shared<World>(worldMax - worldMin);
-    printf("world size %d %d %d\n", world->worldDimension.x,
-           world->worldDimension.y, world->worldDimension.z);
-    // open the region file
-    for (const auto &filename : filenames) {
-        FILE *fp = fopen(filename.c_str(), "rb");
-        if (!fp) {
-            printf("failed to open file\n");
-            return nullptr;
+    // A copy of the voxels cut down to the tight bound of the non-air ones,
+    // the size McLoader gives a world, so a world filled chunk by chunk is
+    // cached as a synchronous load would be. The octree is not built.
+    // nullptr if there are no voxels.
+    std::shared_ptr<World> cropped() const {
+        const int width = BrickMap::brickWidth;
+        std::vector<LeafBound> slabs(voxels.gridDimension.z);
+        parallelFor(slabs.size(), [&](size_t z) {
+            ivec3 pmin(0, 0, int(z) * width);
+            slabs[z] = scanLeaf(
+                Box3i{pmin, min(pmin + ivec3(worldDimension.x, worldDimension.y, width),
+                                worldDimension)});
+        });
+        LeafBound bound;
+        for (const auto &slab : slabs) {
+            bound.pmin = min(bound.pmin, slab.pmin);
+            bound.pmax = max(bound.pmax, slab.pmax);
         }
-
-        // output file
-        FILE *fpOutput = stdout; // fopen("output.txt", "w");
-        if (!fpOutput) {
-            printf("failed to open output file\n");
+        if (bound.empty()) {
             return nullptr;
         }
-
-        enkiRegionFile regionFile = enkiRegionFileLoad(fp);
-
-        for (int i = 0; i < ENKI_MI_REGION_CHUNKS_NUMBER; i++) {
-            enkiNBTDataStream stream;
-            enkiInitNBTDataStreamForChunk(regionFile, i, &stream);
-            if (stream.dataLength) {
-                enkiChunkBlockData aChunk = enkiNBTReadChunk(&stream);
-                enkiMICoordinate chunkOriginPos =
-                    enkiGetChunkOrigin(&aChunk); // y always 0
-                ivec3 chunkPos =
-                    ivec3(chunkOriginPos.x, chunkOriginPos.y, chunkOriginPos.z);
-
-                //            fprintf(fpOutput, "Chunk at xyz{ %d, %d, %d }
-                //            Number of sections: %d \n", chunkOriginPos.x,
-                //                    chunkOriginPos.y, chunkOriginPos.z,
-                //                    aChunk.countOfSections);
-
-                // iterate through chunk and count non 0 voxels as a demo
-                int64_t numVoxels = 0;
-                for (int section = 0; section < ENKI_MI_NUM_SECTIONS_PER_CHUNK;
-                     ++section) {
-                    if (aChunk.sections[section]) {
-                        enkiMICoordinate sectionOrigin =
-                            enkiGetChunkSectionOrigin(&aChunk, section);
-
-                        enkiMICoordinate sPos;
-                        // note order x then z then y iteration for cache
-                        // efficiency
-                        for (sPos.y = 0;
-                             sPos.y < ENKI_MI_NUM_SECTIONS_PER_CHUNK;
-                             ++sPos.y) {
-                            for (sPos.z = 0;
-                                 sPos.z < ENKI_MI_NUM_SECTIONS_PER_CHUNK;
-                                 ++sPos.z) {
-                                for (sPos.x = 0;
-                                     sPos.x < ENKI_MI_NUM_SECTIONS_PER_CHUNK;
-                                     ++sPos.x) {
-                                    uint8_t voxel = enkiGetChunkSectionVoxel(
-                                        &aChunk, section, sPos);
-                                    auto p =
-                                        ivec3(sPos.x, sPos.y, sPos.z) +
-                                        ivec3(sectionOrigin.x, sectionOrigin.y,
-                                              sectionOrigin.z) -
-                                        worldMin;
-                                    (*world)(p) = voxel;
-                                }
+        auto world = std::make_shared<World>(bound.pmax - bound.pmin + ivec3(1));
+        world->origin = origin + bound.pmin;
+        // bricks are given storage if a source brick under them is not all
+        // air, then filled in parallel as in McLoader
+        auto &target = world->voxels;
+        std::vector<ivec3> bricks;
+        for (int z = 0; z < target.gridDimension.z; z++) {
+            for (int y = 0; y < target.gridDimension.y; y++) {
+                for (int x = 0; x < target.gridDimension.x; x++) {
+                    ivec3 p0 = bound.pmin + ivec3(x, y, z) * width;
+                    ivec3 p1 = min(p0 + ivec3(width), bound.pmax + ivec3(1)) - ivec3(1);
+                    bool occupied = false;
+                    for (int bz = p0.z / width; bz <= p1.z / width; bz++) {
+                        for (int by = p0.y / width; by <= p1.y / width; by++) {
+                            for (int bx = p0.x / width; bx <= p1.x / width; bx++) {
+                                occupied |= voxels.grid[voxels.brickIndex(ivec3(bx, by, bz))] !=
+                                            BrickMap::uniformBrick;
                             }
                         }
                     }
+                    if (occupied) {
+                        target.allocate(ivec3(x, y, z));
+                        bricks.emplace_back(x, y, z);
+                    }
+                }
+            }
+        }
+        parallelFor(bricks.size(), [&](size_t i) {
+            uint8_t *data = target.brickData(bricks[i]);
+            ivec3 p0 = bricks[i] * width;
+            ivec3 p1 = min(p0 + ivec3(width), world->worldDimension);
+            for (int z = p0.z; z < p1.z; z++) {
+                for (int y = p0.y; y < p1.y; y++) {
+                    for (int x = p0.x; x < p1.x; x++) {
+                        data[BrickMap::voxelOffset(ivec3(x, y, z) - p0)] =
+                            voxels.get(bound.pmin + ivec3(x, y, z));
+                    }
+                }
+            }
+        });
+        target.compact();
+        return world;
+    }
+
+    // Replaces the column of the chunk at position (in chunk coordinates)
+    // with chunk, or with air if chunk is null. The column is clipped to the
+    // world, whose bounds stay fixed. Bricks left uniform are released.
+    // Returns the edited box, nullopt if the column is outside the world.
+    std::optional<Box3i> replaceChunk(const ivec2 &position,
+                                      const DecodedChunk *chunk) {
+        const int size = ENKI_MI_SIZE_SECTIONS;
+        const int width = BrickMap::brickWidth;
+        ivec3 column = ivec3(position.x, 0, position.y) * size -
+                       ivec3(origin.x, 0, origin.z);
+        Box3i box{max(column, ivec3(0)),
+                  min(column + ivec3(size, worldDimension.y, size),
+                      worldDimension)};
+        if (any(lessThanEqual(box.pmax, box.pmin))) {
+            return std::nullopt;
+        }
+        ivec3 brickMin = box.pmin / width;
+        ivec3 brickMax = (box.pmax - 1) / width;
+        auto forEachBrick = [&](auto &&f) {
+            for (int z = brickMin.z; z <= brickMax.z; z++) {
+                for (int y = brickMin.y; y <= brickMax.y; y++) {
+                    for (int x = brickMin.x; x <= brickMax.x; x++) {
+                        f(ivec3(x, y, z));
+                    }
+                }
+            }
+        };
+        // bricks may be shared with neighbouring columns, only the part
+        // inside the column is cleared
+        forEachBrick([&](const ivec3 &brick) {
+            if (voxels.grid[voxels.brickIndex(brick)] == BrickMap::uniformBrick) {
+                return;
+            }
+            uint8_t *data = voxels.allocate(brick);
+            ivec3 lo = max(box.pmin - brick * width, ivec3(0));
+            ivec3 hi = min(box.pmax - brick * width, ivec3(width));
+            for (int z = lo.z; z < hi.z; z++) {
+                for (int y = lo.y; y < hi.y; y++) {
+                    memset(data + BrickMap::voxelOffset(ivec3(lo.x, y, z)), 0,
+                           hi.x - lo.x);
+                }
+            }
+        });
+        if (chunk) {
+            for (int pass = 0; pass < 2; pass++) {
+                const uint8_t *src = chunk->blocks.data();
+                for (int section = 0; section < ENKI_MI_NUM_SECTIONS_PER_CHUNK;
+                     ++section) {
+                    if (!(chunk->sectionMask & (1u << section))) {
+                        continue;
+                    }
+                    auto sectionOrigin =
+                        ivec3(position.x, section + ENKI_MI_MIN_SECTION_Y,
+                              position.y) *
+                            size -
+                        origin;
+                    if (pass == 0) {
+                        allocateSection(sectionOrigin, src);
+                    } else {
+                        importSection(sectionOrigin, src);
+                    }
+                    src += size * size * size;
+                }
+            }
+        }
+        forEachBrick([&](const ivec3 &brick) {
+            voxels.release(brick);
+            dirtyBricks.push_back(voxels.brickIndex(brick));
+        });
+        return box;
+    }
+
+    // Chebyshev distance in bricks from each brick to the nearest brick that
+    // is not all air, at most maxEmptyDistance. Bricks closer than that are
+    // all air, which lets the DDA jump over them.
+    static const int maxEmptyDistance = 15;
+    std::vector<uint8_t> emptyDistance;
+
+    // Recomputes the distances of the bricks in box (in bricks). The
+    // distance is separable: along x from the occupancy, then along y from
+    // the x distances, then along z. Only the bricks within
+    // maxEmptyDistance of box are read.
+    void updateEmptyDistance(Box3i box) {
+        const int k = maxEmptyDistance;
+        const ivec3 n = voxels.gridDimension;
+        emptyDistance.resize(voxels.grid.size(), uint8_t(k));
+        box = Box3i{max(box.pmin, ivec3(0)), min(box.pmax, n)};
+        if (any(lessThanEqual(box.pmax, box.pmin))) {
+            return;
+        }
+        Box3i source{max(box.pmin - k, ivec3(0)), min(box.pmax + k, n)};
+        ivec3 size = source.size();
+        auto at = [&](const ivec3 &p) {
+            return (p.x - source.pmin.x) +
+                   size_t(size.x) * ((p.y - source.pmin.y) +
+                                     size_t(size.y) * (p.z - source.pmin.z));
+        };
+        std::vector<uint8_t> distance(size_t(size.x) * size.y * size.z);
+        parallelFor(distance.size(), [&](size_t i) {
+            ivec3 p = source.pmin + ivec3(i % size.x, i / size.x % size.y,
+                                          i / (size_t(size.x) * size.y));
+            distance[i] = voxels.grid[voxels.brickIndex(p)] == BrickMap::uniformBrick
+                              ? uint8_t(k)
+                              : 0;
+        });
+        std::vector<uint8_t> next(distance.size());
+        for (int axis = 0; axis < 3; axis++) {
+            // lines along axis, indexed by the other two coordinates
+            int u = (axis + 1) % 3, v = (axis + 2) % 3;
+            parallelFor(size_t(size[u]) * size[v], [&](size_t line) {
+                ivec3 p = source.pmin;
+                p[u] += int(line % size[u]);
+                p[v] += int(line / size[u]);
+                for (int x = source.pmin[axis]; x < source.pmax[axis]; x++) {
+                    int best = k;
+                    int lo = std::max(x - k, source.pmin[axis]);
+                    int hi = std::min(x + k, source.pmax[axis] - 1);
+                    for (int y = lo; y <= hi && best > 0; y++) {
+                        ivec3 q = p;
+                        q[axis] = y;
+                        best = std::min(best, std::max<int>(std::abs(y - x),
+                                                            distance[at(q)]));
+                    }
+                    ivec3 q = p;
+                    q[axis] = x;
+                    next[at(q)] = uint8_t(best);
+                }
+            });
+            std::swap(distance, next);
+        }
+        for (int z = box.pmin.z; z < box.pmax.z; z++) {
+            for (int y = box.pmin.y; y < box.pmax.y; y++) {
+                memcpy(&emptyDistance[voxels.brickIndex(ivec3(box.pmin.x, y, z))],
+                       &distance[at(ivec3(box.pmin.x, y, z))],
+                       box.pmax.x - box.pmin.x);
+            }
+        }
+    }
+
+    // Updates the distances around the dirty bricks and uploads the region
+    // that changed
+    void uploadEmptyDistance() {
+        Box3i box{ivec3(std::numeric_limits<int>::max()),
+                  ivec3(std::numeric_limits<int>::min())};
+        const ivec3 n = voxels.gridDimension;
+        for (auto i : dirtyBricks) {
+            ivec3 p(i % n.x, i / n.x % n.y, i / (size_t(n.x) * n.y));
+            box.pmin = min(box.pmin, p);
+            box.pmax = max(box.pmax, p + 1);
+        }
+        if (dirtyBricks.empty()) {
+            return;
+        }
+        // distances change up to maxEmptyDistance away from an edit
+        box = Box3i{max(box.pmin - maxEmptyDistance, ivec3(0)),
+                    min(box.pmax + maxEmptyDistance, n)};
+        updateEmptyDistance(box);
+        ivec3 size = box.size();
+        glBindTexture(GL_TEXTURE_3D, emptyDistanceTexture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, n.x);
+        glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, n.y);
+        glTexSubImage3D(GL_TEXTURE_3D, 0, box.pmin.x, box.pmin.y, box.pmin.z,
+                        size.x, size.y, size.z, GL_RED_INTEGER, GL_UNSIGNED_BYTE,
+                        &emptyDistance[voxels.brickIndex(box.pmin)]);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    }
+
+    // Calls f(first, last) for each run of consecutive values in a sorted
+    // vector, last excluded
+    template <class F>
+    static void forEachRange(const std::vector<size_t> &sorted, F &&f) {
+        for (size_t i = 0; i < sorted.size();) {
+            size_t j = i + 1;
+            while (j < sorted.size() && sorted[j] == sorted[j - 1] + 1) {
+                j++;
+            }
+            f(sorted[i], sorted[j - 1] + 1);
+            i = j;
+        }
+    }
+
+    // Builds the DAG of the voxels and uploads it in place of the brick map
+    void uploadDag() {
+        using clock = std::chrono::high_resolution_clock;
+        auto t0 = clock::now();
+        auto dag = VoxelDag::build(voxels);
+        std::chrono::duration<double> elapsed = clock::now() - t0;
+        printf("voxel DAG: %d levels, %zu nodes, %zu leaves, %.1f MB instead "
+               "of %.1f MB, built in %.2fs\n",
+               dag.levels, dag.nodes.size(), dag.leaves.size(),
+               dag.bytes() / (1024.0 * 1024.0),
+               (voxels.grid.size() * sizeof(uint32_t) + voxels.pool.size()) /
+                   (1024.0 * 1024.0),
+               elapsed.count());
+        dagRoot = dag.root;
+        dagLevels = dag.levels;
+        // keep the buffers non-empty, a zero sized SSBO cannot be bound
+        dag.nodes.resize(std::max<size_t>(dag.nodes.size(), 1));
+        dag.leaves.resize(std::max<size_t>(dag.leaves.size(), 1));
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, brickGridBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     dag.nodes.size() * sizeof(VoxelDag::Children),
+                     dag.nodes.data(), GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, brickPoolBuffer);
+        poolBufferSize = dag.leaves.size() * sizeof(uint64_t);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, poolBufferSize, dag.leaves.data(),
+                     GL_DYNAMIC_COPY);
+    }
+    // Builds the 64-tree of the voxels and uploads it
+    void uploadTree64() {
+        using clock = std::chrono::high_resolution_clock;
+        auto t0 = clock::now();
+        auto tree = Tree64::build(voxels);
+        std::chrono::duration<double> elapsed = clock::now() - t0;
+        printf("64-tree: %d levels, %zu nodes, %.1f MB, built in %.2fs\n",
+               tree.levels, tree.nodes.size(),
+               tree.nodes.size() * sizeof(Tree64Node) / (1024.0 * 1024.0),
+               elapsed.count());
+        tree64Levels = tree.levels;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, tree64Buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     tree.nodes.size() * sizeof(Tree64Node), tree.nodes.data(),
+                     GL_DYNAMIC_COPY);
+    }
+    void updateOccupancy(size_t slot) {
+        const uint8_t *brick = &voxels.pool[slot * BrickMap::brickVolume];
+        uint32_t *words = &occupancy[slot * occupancyWords];
+        for (int w = 0; w < occupancyWords; w++) {
+            uint32_t bits = 0;
+            for (int i = 0; i < 32; i++) {
+                bits |= uint32_t(brick[w * 32 + i] != 0) << i;
+            }
+            words[w] = bits;
+        }
+    }
+    // the occupancy buffer is sized along with the pool buffer
+    size_t occupancyBufferSize() const {
+        return std::max<size_t>(4, poolBufferSize / BrickMap::brickVolume *
+                                       occupancyWords * sizeof(uint32_t));
+    }
+    // Writes the dirty brick cells and the bricks they reference, returns
+    // the number of bricks written
+    size_t uploadBrickEdits() {
+        std::vector<size_t> slots;
+        for (auto i : dirtyBricks) {
+            if (!(voxels.grid[i] & BrickMap::uniformBrick)) {
+                slots.push_back(voxels.grid[i]);
+            }
+        }
+        std::sort(slots.begin(), slots.end());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, brickGridBuffer);
+        forEachRange(dirtyBricks, [&](size_t first, size_t last) {
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, first * sizeof(uint32_t),
+                            (last - first) * sizeof(uint32_t),
+                            &voxels.grid[first]);
+        });
+        occupancy.resize(voxels.brickCount() * occupancyWords);
+        for (auto slot : slots) {
+            updateOccupancy(slot);
+        }
+        const size_t occupancyBytes = occupancyWords * sizeof(uint32_t);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, brickPoolBuffer);
+        if (voxels.pool.size() > poolBufferSize) {
+            poolBufferSize = voxels.pool.size() + voxels.pool.size() / 4;
+            glBufferData(GL_SHADER_STORAGE_BUFFER, poolBufferSize, nullptr,
+                         GL_DYNAMIC_COPY);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, voxels.pool.size(),
+                            voxels.pool.data());
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, occupancyBuffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, occupancyBufferSize(),
+                         nullptr, GL_DYNAMIC_COPY);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+                            occupancy.size() * sizeof(uint32_t),
+                            occupancy.data());
+        } else {
+            forEachRange(slots, [&](size_t first, size_t last) {
+                glBufferSubData(GL_SHADER_STORAGE_BUFFER,
+                                first * BrickMap::brickVolume,
+                                (last - first) * BrickMap::brickVolume,
+                                &voxels.pool[first * BrickMap::brickVolume]);
+            });
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, occupancyBuffer);
+            forEachRange(slots, [&](size_t first, size_t last) {
+                glBufferSubData(GL_SHADER_STORAGE_BUFFER, first * occupancyBytes,
+                                (last - first) * occupancyBytes,
+                                &occupancy[first * occupancyWords]);
+            });
+        }
+        return slots.size();
+    }
+
+    // Uploads the edits made since the last upload. Buffers that became too
+    // small are reallocated with some headroom, otherwise only the changed
+    // ranges are written. The DAG shares subtrees across the world and the
+    // 64-tree packs the children of a node together, so they are rebuilt and
+    // uploaded whole.
+    void uploadEdits() {
+        std::sort(dirtyBricks.begin(), dirtyBricks.end());
+        dirtyBricks.erase(std::unique(dirtyBricks.begin(), dirtyBricks.end()),
+                          dirtyBricks.end());
+        size_t bricks = 0;
+        if (!useDag) {
+            bricks = uploadBrickEdits();
+        } else if (!dirtyBricks.empty()) {
+            uploadDag();
+        }
+        if (tree64Levels > 0 && !dirtyBricks.empty()) {
+            uploadTree64();
+        }
+        uploadEmptyDistance();
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, octreeBuffer);
+        size_t octreeSize = octree.size() * sizeof(OctreeNode);
+        if (octreeSize > octreeBufferSize) {
+            octreeBufferSize = octreeSize + octreeSize / 4;
+            glBufferData(GL_SHADER_STORAGE_BUFFER, octreeBufferSize, nullptr,
+                         GL_DYNAMIC_COPY);
+            octreeUploadFrom = 0;
+        }
+        // nodes past the end of a shrunk octree are never reached
+        if (octreeUploadFrom < octree.size()) {
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER,
+                            octreeUploadFrom * sizeof(OctreeNode),
+                            (octree.size() - octreeUploadFrom) * sizeof(OctreeNode),
+                            &octree[octreeUploadFrom]);
+        }
+        printf("uploaded %zu brick cells, %zu bricks, %zu octree nodes\n",
+               dirtyBricks.size(), bricks,
+               octree.size() - std::min(octreeUploadFrom, octree.size()));
+        dirtyBricks.clear();
+        octreeUploadFrom = std::numeric_limits<size_t>::max();
+    }
+
+    void setUpTexture() {
+        if (!materialsSSBO) {
+            createBuffers();
+        }
+        if (useDag) {
+            uploadDag();
+        } else {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, brickGridBuffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER,
+                         sizeof(uint32_t) * voxels.grid.size(),
+                         voxels.grid.data(), GL_DYNAMIC_COPY);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, brickPoolBuffer);
+            // keep the buffer non-empty, a zero sized SSBO cannot be bound
+            poolBufferSize = std::max<size_t>(4, voxels.pool.size());
+            glBufferData(GL_SHADER_STORAGE_BUFFER, poolBufferSize,
+                         voxels.pool.empty() ? nullptr : voxels.pool.data(),
+                         GL_DYNAMIC_COPY);
+            occupancy.resize(voxels.brickCount() * occupancyWords);
+            parallelFor(voxels.brickCount(),
+                        [&](size_t slot) { updateOccupancy(slot); });
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, occupancyBuffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, occupancyBufferSize(),
+                         occupancy.empty() ? nullptr : occupancy.data(),
+                         GL_DYNAMIC_COPY);
+        }
+        if (tree64Levels > 0) {
+            uploadTree64();
+        }
+        updateEmptyDistance(Box3i{ivec3(0), voxels.gridDimension});
+        const ivec3 n = voxels.gridDimension;
+        glBindTexture(GL_TEXTURE_3D, emptyDistanceTexture);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage3D(GL_TEXTURE_3D, 0, GL_R8UI, n.x, n.y, n.z, 0,
+                     GL_RED_INTEGER, GL_UNSIGNED_BYTE, emptyDistance.data());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, octreeBuffer);
+        octreeBufferSize = sizeof(OctreeNode) * octree.size();
+        glBufferData(GL_SHADER_STORAGE_BUFFER, octreeBufferSize, octree.data(),
+                     GL_DYNAMIC_COPY);
+        dirtyBricks.clear();
+        octreeUploadFrom = std::numeric_limits<size_t>::max();
+    }
+};
+
+extern BlockDefinition gBlockDefinitions[];
+
+// Maps the namespaced block names of 1.13+ palettes to legacy block ids.
+// Most names are the legacy name in snake case ("Oak Planks" is
+// minecraft:oak_planks). Renamed blocks are listed, and the variants added
+// since are mapped by their suffix ("minecraft:birch_planks" to Oak Planks).
+struct BlockNameTable {
+    static constexpr uint8_t unknownBlock = 253;
+    std::unordered_map<std::string, uint8_t> ids;
+
+    BlockNameTable() {
+        for (int i = 0; i < MATERIAL_COUNT; i++) {
+            std::string name;
+            for (const char *c = gBlockDefinitions[i].name; *c; c++) {
+                if (isalnum((unsigned char)*c)) {
+                    name += char(tolower((unsigned char)*c));
+                } else if (*c == ' ') {
+                    name += '_';
                 }
-                // fprintf(fpOutput, "   Chunk has %g non zero voxels\n",
-                // (float) numVoxels);
+            }
+            auto grey = name.find("grey");
+            if (grey != std::string::npos) {
+                name.replace(grey, 4, "gray");
+            }
+            // the first of the duplicate names wins (Water, not Stationary)
+            ids.emplace(name, uint8_t(i));
+        }
+        static const std::pair<const char *, uint8_t> renamed[] = {
+            {"cave_air", 0},         {"void_air", 0},
+            {"granite", 1},          {"diorite", 1},
+            {"andesite", 1},         {"deepslate", 1},
+            {"tuff", 1},             {"calcite", 1},
+            {"coarse_dirt", 3},      {"podzol", 3},
+            {"rooted_dirt", 3},      {"red_sand", 12},
+            {"seagrass", 8},         {"tall_seagrass", 8},
+            {"kelp", 8},             {"kelp_plant", 8},
+            {"bubble_column", 8},    {"short_grass", 31},
+            {"tall_grass", 31},      {"fern", 31},
+            {"large_fern", 31},      {"lapis_ore", 21},
+            {"lapis_block", 22},     {"gold_block", 41},
+            {"iron_block", 42},      {"diamond_block", 57},
+            {"emerald_block", 133},  {"coal_block", 173},
+            {"redstone_block", 152}, {"quartz_block", 155},
+            {"hay_block", 170},      {"vine", 106},
+            {"wall_torch", 50},      {"jack_o_lantern", 91},
+            {"spawner", 52},         {"dirt_path", 208},
+            {"nether_bricks", 112},  {"moss_block", 2},
+            {"sugar_cane", 83},      {"infested_stone", 97},
+        };
+        for (auto &[name, id] : renamed) {
+            ids[name] = id;
+        }
+    }
+
+    uint8_t operator()(const char *name, size_t length) const {
+        std::string key(name, length);
+        if (key.compare(0, 10, "minecraft:") == 0) {
+            key.erase(0, 10);
+        }
+        auto it = ids.find(key);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        // longest suffixes first
+        static const std::pair<const char *, uint8_t> suffixes[] = {
+            {"_stained_glass_pane", 160}, {"_stained_glass", 95},
+            {"_concrete_powder", 252},    {"_concrete", 251},
+            {"_terracotta", 159},         {"_pressure_plate", 70},
+            {"_fence_gate", 107},         {"_wall_banner", 177},
+            {"_trapdoor", 96},            {"_planks", 5},
+            {"_leaves", 18},              {"_sapling", 6},
+            {"_carpet", 171},             {"_stairs", 53},
+            {"_button", 77},              {"_banner", 176},
+            {"_fence", 85},               {"_tulip", 38},
+            {"_wool", 35},                {"_wood", 17},
+            {"_slab", 44},                {"_door", 64},
+            {"_wall", 139},               {"_sign", 63},
+            {"_log", 17},                 {"_bed", 26},
+        };
+        for (auto &[suffix, id] : suffixes) {
+            size_t n = strlen(suffix);
+            if (key.size() > n && key.compare(key.size() - n, n, suffix) == 0) {
+                return id;
+            }
+        }
+        return unknownBlock;
+    }
+
+    static const BlockNameTable &get() {
+        static BlockNameTable table;
+        return table;
+    }
+};
+
+// Unpacks a 1.13+ palette section to legacy block ids, 4096 bytes YZX
+bool decodePaletteSection(const enkiChunkSectionPalette &palette,
+                          uint8_t *blocks) {
+    const int sectionVolume = ENKI_MI_SIZE_SECTIONS * ENKI_MI_SIZE_SECTIONS *
+                              ENKI_MI_SIZE_SECTIONS;
+    if (palette.paletteSize <= 0 || palette.paletteSize > sectionVolume) {
+        return false;
+    }
+    std::vector<const char *> names(palette.paletteSize);
+    std::vector<uint16_t> lengths(palette.paletteSize);
+    if (enkiGetSectionPaletteNames(&palette, names.data(), lengths.data(),
+                                   palette.paletteSize) != palette.paletteSize) {
+        return false;
+    }
+    const auto &table = BlockNameTable::get();
+    std::vector<uint8_t> lookup(palette.paletteSize);
+    for (int i = 0; i < palette.paletteSize; i++) {
+        lookup[i] = names[i] ? table(names[i], lengths[i]) : 0;
+    }
+    return enkiUnpackBlockStates(&palette, lookup.data(), blocks);
+}
+
+// Inflate buffer of the calling thread, reused for every chunk it decodes.
+struct InflateArena {
+    enkiInflateArena arena;
+    InflateArena() { enkiInflateArenaInit(&arena); }
+    ~InflateArena() { enkiInflateArenaFree(&arena); }
+    static enkiInflateArena *get() {
+        thread_local InflateArena local;
+        return &local.arena;
+    }
+};
+
+struct InflateStats {
+    std::atomic<uint64_t> compressedBytes{0};
+    std::atomic<uint64_t> uncompressedBytes{0};
+    std::atomic<uint64_t> nanoseconds{0};
+};
 
-                enkiNBTRewind(&stream);
-                // PrintStreamStructureToFile(&stream, fpOutput);
+std::optional<DecodedChunk> decodeChunk(enkiRegionFile regionFile, int index,
+                                        InflateStats &stats) {
+    if (!enkiHasChunk(regionFile, index)) {
+        return std::nullopt;
+    }
+    enkiPrefetchChunk(regionFile, index);
+    auto arena = InflateArena::get();
+    auto compressedBytes = arena->compressedBytes;
+    auto uncompressedBytes = arena->uncompressedBytes;
+    auto t0 = std::chrono::high_resolution_clock::now();
+    enkiNBTDataStream stream;
+    enkiInitNBTDataStreamForChunkInArena(regionFile, index, &stream, arena);
+    stats.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::high_resolution_clock::now() - t0)
+                             .count();
+    stats.compressedBytes += arena->compressedBytes - compressedBytes;
+    stats.uncompressedBytes += arena->uncompressedBytes - uncompressedBytes;
+    if (!stream.dataLength) {
+        enkiNBTFreeAllocations(&stream);
+        return std::nullopt;
+    }
+    enkiChunkBlockData aChunk = enkiNBTScanChunk(&stream);
+    static std::atomic<bool> warnedDroppedSections(false);
+    if (aChunk.countOfDroppedSections && !warnedDroppedSections.exchange(true)) {
+        printf("chunk %d %d: sections outside blocks %d to %d are dropped\n",
+               aChunk.xPos, aChunk.zPos,
+               ENKI_MI_MIN_SECTION_Y * ENKI_MI_SIZE_SECTIONS,
+               (ENKI_MI_MIN_SECTION_Y + ENKI_MI_NUM_SECTIONS_PER_CHUNK) *
+                       ENKI_MI_SIZE_SECTIONS -
+                   1);
+    }
+    DecodedChunk chunk;
+    chunk.position = ivec2(aChunk.xPos, aChunk.zPos);
+    const int sectionVolume = ENKI_MI_SIZE_SECTIONS * ENKI_MI_SIZE_SECTIONS *
+                              ENKI_MI_SIZE_SECTIONS;
+    uint8_t unpacked[ENKI_MI_SIZE_SECTIONS * ENKI_MI_SIZE_SECTIONS *
+                     ENKI_MI_SIZE_SECTIONS];
+    for (int section = 0; section < ENKI_MI_NUM_SECTIONS_PER_CHUNK; ++section) {
+        const uint8_t *src = aChunk.sections[section];
+        if (!src && aChunk.palettes[section].pPalette &&
+            decodePaletteSection(aChunk.palettes[section], unpacked)) {
+            src = unpacked;
+        }
+        if (!src) {
+            continue;
+        }
+        enkiMICoordinate sectionOrigin =
+            enkiGetChunkSectionOrigin(&aChunk, section);
+        ivec3 origin(sectionOrigin.x, sectionOrigin.y, sectionOrigin.z);
+        // sections are stored YZX, so each (y, z) is a contiguous row in x
+        bool empty = true;
+        for (int y = 0; y < ENKI_MI_SIZE_SECTIONS; y++) {
+            for (int z = 0; z < ENKI_MI_SIZE_SECTIONS; z++) {
+                int first, last;
+                if (rowExtent(src + (y * ENKI_MI_SIZE_SECTIONS + z) *
+                                        ENKI_MI_SIZE_SECTIONS,
+                              ENKI_MI_SIZE_SECTIONS, first, last)) {
+                    chunk.pmin = min(chunk.pmin, origin + ivec3(first, y, z));
+                    chunk.pmax = max(chunk.pmax, origin + ivec3(last, y, z));
+                    empty = false;
+                }
             }
-            enkiNBTFreeAllocations(&stream);
         }
+        // all air sections are dropped here and never touched again
+        if (!empty) {
+            chunk.sectionMask |= 1u << section;
+            chunk.blocks.insert(chunk.blocks.end(), src, src + sectionVolume);
+        }
+    }
+    enkiNBTFreeAllocations(&stream);
+    return chunk;
+}
 
-        enkiRegionFileFreeAllocations(&regionFile);
+// Region coordinates from a r.X.Z.mca filename
+std::optional<ivec2> regionCoordinates(const std::string &filename) {
+    auto name = fs::path(filename).filename().string();
+    int x, z, length = 0;
+    if (sscanf(name.c_str(), "r.%d.%d.mca%n", &x, &z, &length) == 2 &&
+        length == (int)name.size()) {
+        return ivec2(x, z);
+    }
+    return std::nullopt;
+}
+
+// True if the columns of blocks from pmin to pmax (x and z, pmax
+// exclusive) intersect bounds
+bool columnsIntersect(const ivec2 &pmin, const ivec2 &pmax,
+                      const Box3i &bounds) {
+    return pmin.x < bounds.pmax.x && bounds.pmin.x < pmax.x &&
+           pmin.y < bounds.pmax.z && bounds.pmin.z < pmax.y;
+}
+bool chunkIntersects(const ivec2 &position, const Box3i &bounds) {
+    ivec2 pmin = position * ENKI_MI_SIZE_SECTIONS;
+    return columnsIntersect(pmin, pmin + ivec2(ENKI_MI_SIZE_SECTIONS), bounds);
+}
+
+// Region files whose region intersects bounds. Files not named r.X.Z.mca
+// are kept, their position being unknown.
+std::vector<std::string> regionFilesIn(const std::vector<std::string> &filenames,
+                                       const Box3i &bounds) {
+    const int regionWidth = 32 * ENKI_MI_SIZE_SECTIONS;
+    std::vector<std::string> result;
+    for (auto &filename : filenames) {
+        auto position = regionCoordinates(filename);
+        if (!position ||
+            columnsIntersect(*position * regionWidth,
+                             (*position + ivec2(1)) * regionWidth, bounds)) {
+            result.push_back(filename);
+        }
+    }
+    return result;
+}
 
-        fclose(fp);
+// Decodes every chunk exactly once, spreading regions and chunks over the
+// worker pool. The world bound is reduced from the decoded chunks instead of
+// a separate pass over the region files. With bounds (block coordinates,
+// pmax exclusive) only the regions and chunks intersecting them are
+// inflated, which the file names and region headers tell without reading
+// the chunks, and the world is clipped to them.
+std::shared_ptr<World> McLoader(const std::vector<std::string> &allFilenames,
+                                const std::optional<Box3i> &bounds = std::nullopt) {
+    using clock = std::chrono::high_resolution_clock;
+    auto t0 = clock::now();
+    auto filenames =
+        bounds ? regionFilesIn(allFilenames, *bounds) : allFilenames;
+    std::vector<std::optional<ivec2>> regionPositions;
+    for (auto &filename : filenames) {
+        regionPositions.push_back(regionCoordinates(filename));
+    }
+    std::vector<enkiRegionFile> regions(filenames.size());
+    parallelFor(filenames.size(), [&](size_t i) {
+        // mapped, so only the header and the sectors of decoded chunks are
+        // ever read. A region that fails to map has no chunks and is skipped.
+        regions[i] = enkiRegionFileMap(filenames[i].c_str());
+        if (!regions[i].pRegionData) {
+            printf("failed to map file %s, skipping it\n", filenames[i].c_str());
+        }
+    });
+    std::vector<std::optional<DecodedChunk>> chunks(
+        regions.size() * ENKI_MI_REGION_CHUNKS_NUMBER);
+    std::vector<InflateStats> inflateStats(regions.size());
+    parallelFor(chunks.size(), [&](size_t i) {
+        size_t region = i / ENKI_MI_REGION_CHUNKS_NUMBER;
+        int index = int(i % ENKI_MI_REGION_CHUNKS_NUMBER);
+        // chunks are indexed x + 32 z in a region
+        if (bounds && regionPositions[region] &&
+            !chunkIntersects(*regionPositions[region] * 32 +
+                                 ivec2(index % 32, index / 32),
+                             *bounds)) {
+            return;
+        }
+        chunks[i] = decodeChunk(regions[region], index, inflateStats[region]);
+        // files with no position in their name are clipped here
+        if (bounds && chunks[i] && !chunkIntersects(chunks[i]->position, *bounds)) {
+            chunks[i].reset();
+        }
+    });
+    for (size_t i = 0; i < regions.size(); i++) {
+        printf("%s: inflated %.2f MB -> %.2f MB in %.1f ms\n",
+               filenames[i].c_str(),
+               inflateStats[i].compressedBytes / (1024.0 * 1024.0),
+               inflateStats[i].uncompressedBytes / (1024.0 * 1024.0),
+               inflateStats[i].nanoseconds / 1e6);
+    }
+    for (auto &region : regions) {
+        enkiRegionFileFreeAllocations(&region);
+    }
+    ivec3 worldMin(std::numeric_limits<int>::max()),
+        worldMax(std::numeric_limits<int>::min());
+    size_t chunkCount = 0;
+    for (const auto &chunk : chunks) {
+        if (chunk && !chunk->empty()) {
+            worldMin = min(worldMin, chunk->pmin);
+            worldMax = max(worldMax, chunk->pmax);
+            chunkCount++;
+        }
+    }
+    if (bounds) {
+        worldMin = max(worldMin, bounds->pmin);
+        worldMax = min(worldMax, bounds->pmax - ivec3(1));
+    }
+    if (chunkCount == 0 || any(greaterThan(worldMin, worldMax))) {
+        printf("no voxels found\n");
+        return nullptr;
+    }
+    printf("%d %d %d  to %d %d %d\n", worldMin.x, worldMin.y, worldMin.z,
+           worldMax.x, worldMax.y, worldMax.z);
+    // worldMax is inclusive
+    auto world = std::make_shared<World>(worldMax - worldMin + ivec3(1));
+    world->origin = worldMin;
+    printf("world size %d %d %d\n", world->worldDimension.x,
+           world->worldDimension.y, world->worldDimension.z);
+    for (const auto &chunk : chunks) {
+        if (!chunk || chunk->empty()) {
+            continue;
+        }
+        const uint8_t *src = chunk->blocks.data();
+        for (int section = 0; section < ENKI_MI_NUM_SECTIONS_PER_CHUNK;
+             ++section) {
+            if (chunk->sectionMask & (1u << section)) {
+                world->allocateSection(
+                    ivec3(chunk->position.x, section + ENKI_MI_MIN_SECTION_Y,
+                          chunk->position.y) *
+                            ENKI_MI_SIZE_SECTIONS -
+                        worldMin,
+                    src);
+                src += ENKI_MI_SIZE_SECTIONS * ENKI_MI_SIZE_SECTIONS *
+                       ENKI_MI_SIZE_SECTIONS;
+            }
+        }
     }
+    // chunks never overlap, so they can be written concurrently
+    parallelFor(chunks.size(), [&](size_t i) {
+        if (!chunks[i] || chunks[i]->empty()) {
+            return;
+        }
+        const auto &chunk = *chunks[i];
+        const uint8_t *src = chunk.blocks.data();
+        for (int section = 0; section < ENKI_MI_NUM_SECTIONS_PER_CHUNK;
+             ++section) {
+            if (chunk.sectionMask & (1u << section)) {
+                world->importSection(
+                    ivec3(chunk.position.x, section + ENKI_MI_MIN_SECTION_Y,
+                          chunk.position.y) *
+                            ENKI_MI_SIZE_SECTIONS -
+                        worldMin,
+                    src);
+                src += ENKI_MI_SIZE_SECTIONS * ENKI_MI_SIZE_SECTIONS *
+                       ENKI_MI_SIZE_SECTIONS;
+            }
+        }
+    });
+    chunks.clear();
+    world->voxels.compact();
+    printf("%zu bricks (%.1f MB) for %zu brick cells\n",
+           world->voxels.brickCount(),
+           world->voxels.pool.size() / (1024.0 * 1024.0),
+           world->voxels.grid.size());
+    std::chrono::duration<double> elapsed = clock::now() - t0;
+    printf("loaded %zu chunks from %zu regions in %.2fs\n", chunkCount,
+           regions.size(), elapsed.count());
     return world;
 }
 
+// Background radiance of LiBackground for one sun direction, precomputed
+// when the sun moves instead of integrating atmosphere() per escaped ray.
+// The optical depth towards the top of the atmosphere is tabulated first by
+// height and zenith angle, standing in for the inner loop of atmosphere().
+// The exposed sky radiance is then tabulated by azimuth and elevation, with
+// more rows near the horizon, and sampled bilinearly by both renderers.
+struct SkyLut {
+    // the atmosphere of LiBackground, seen from 1 km above the ground
+    static constexpr float sunIntensity = 22.0f;
+    static constexpr float planetRadius = 6371e3f;
+    static constexpr float atmosphereRadius = 6471e3f;
+    static constexpr float viewHeight = 6372e3f;
+    static constexpr float rayleighScaleHeight = 8e3f;
+    static constexpr float mieScaleHeight = 1.2e3f;
+    static constexpr float mie = 21e-6f;
+    static constexpr float mieG = 0.758f;
+    static constexpr int primarySteps = 16, secondarySteps = 8;
+    // optical depth by cos zenith angle (columns) and height (rows)
+    static constexpr int transmittanceWidth = 256, transmittanceHeight = 128;
+    // sky view by azimuth (columns) and elevation (rows)
+    static constexpr int width = 256, height = 128;
+
+    vec3 sunPos = vec3(0); // normalized
+    vec3 sunRadiance = vec3(0); // LiBackground towards the sun
+    std::vector<vec2> transmittance; // log of the Rayleigh, Mie optical depth
+    std::vector<vec4> skyView;
+
+    static vec3 rayleigh() { return vec3(5.5e-6f, 13.0e-6f, 22.4e-6f); }
+    static vec2 rsi(const vec3 &r0, const vec3 &rd, float sr) {
+        float a = dot(rd, rd);
+        float b = 2.0f * dot(rd, r0);
+        float c = dot(r0, r0) - (sr * sr);
+        float d = (b * b) - 4.0f * a * c;
+        if (d < 0.0f)
+            return vec2(1e5f, -1e5f);
+        return vec2((-b - std::sqrt(d)) / (2.0f * a),
+                    (-b + std::sqrt(d)) / (2.0f * a));
+    }
+    // Rows start below the ground, as atmosphere() does not stop its primary
+    // ray there. Heights are mapped quadratically to the rows, as most of
+    // the air is low, and cos zenith angles by their square root on either
+    // side of the horizontal, where the optical depth changes fastest.
+    // Heights outside the table are clamped.
+    static constexpr float minHeight = -10e3f;
+    static constexpr float maxHeight = atmosphereRadius - planetRadius;
+    static float heightToRow(float h) {
+        float x = std::sqrt(std::clamp((h - minHeight) / (maxHeight - minHeight),
+                                       0.0f, 1.0f));
+        return x * (transmittanceHeight - 1);
+    }
+    static float muToColumn(float mu) {
+        float x = 0.5f + 0.5f * (mu < 0.0f ? -1.0f : 1.0f) *
+                             std::sqrt(std::min(std::abs(mu), 1.0f));
+        return x * (transmittanceWidth - 1);
+    }
+    // log of the optical depth along the secondary ray of atmosphere(). Like
+    // atmosphere() it does not stop at the ground, the depths of rays through
+    // the planet are clamped.
+    static vec2 logOpticalDepth(float h, float mu) {
+        vec3 pos(0, planetRadius + h, 0);
+        vec3 dir(std::sqrt(std::max(0.0f, 1.0f - mu * mu)), mu, 0);
+        float stepSize = rsi(pos, dir, atmosphereRadius).y / float(secondarySteps);
+        vec2 depth(0.0f);
+        for (int j = 0; j < secondarySteps; j++) {
+            vec3 p = pos + dir * (stepSize * (j + 0.5f));
+            float height = length(p) - planetRadius;
+            depth += vec2(std::exp(-height / rayleighScaleHeight),
+                          std::exp(-height / mieScaleHeight)) *
+                     stepSize;
+        }
+        depth = clamp(depth, vec2(1e-20f), vec2(1e20f));
+        return vec2(std::log(depth.x), std::log(depth.y));
+    }
+    vec2 lookUpOpticalDepth(const vec3 &p, const vec3 &dir) const {
+        float r = length(p);
+        float u = muToColumn(dot(p, dir) / r);
+        float v = heightToRow(r - planetRadius);
+        int x = std::min(int(u), transmittanceWidth - 2);
+        int y = std::min(int(v), transmittanceHeight - 2);
+        float fx = u - x, fy = v - y;
+        const vec2 *row = &transmittance[size_t(y) * transmittanceWidth + x];
+        vec2 depth = (row[0] * (1.0f - fx) + row[1] * fx) * (1.0f - fy) +
+                     (row[transmittanceWidth] * (1.0f - fx) +
+                      row[transmittanceWidth + 1] * fx) *
+                         fy;
+        return vec2(std::exp(depth.x), std::exp(depth.y));
+    }
+    // atmosphere() with its inner loop looked up, then exposed
+    vec3 radiance(vec3 r) const {
+        const vec3 r0(0, viewHeight, 0);
+        const vec3 kRlh = rayleigh();
+        const float PI = 3.141592f;
+        r = normalize(r);
+        vec2 p = rsi(r0, r, atmosphereRadius);
+        if (p.x > p.y)
+            return vec3(0);
+        p.y = std::min(p.y, rsi(r0, r, planetRadius).x);
+        float iStepSize = (p.y - p.x) / float(primarySteps);
+        vec3 totalRlh = vec3(0);
+        vec3 totalMie = vec3(0);
+        vec2 iOd = vec2(0.0f);
+        float mu = dot(r, sunPos);
+        float mumu = mu * mu;
+        float gg = mieG * mieG;
+        float pRlh = 3.0f / (16.0f * PI) * (1.0f + mumu);
+        float pMie = 3.0f / (8.0f * PI) * ((1.0f - gg) * (mumu + 1.0f)) /
+                     (std::pow(1.0f + gg - 2.0f * mu * mieG, 1.5f) * (2.0f + gg));
+        for (int i = 0; i < primarySteps; i++) {
+            vec3 iPos = r0 + r * (iStepSize * (i + 0.5f));
+            float iHeight = length(iPos) - planetRadius;
+            float odStepRlh = std::exp(-iHeight / rayleighScaleHeight) * iStepSize;
+            float odStepMie = std::exp(-iHeight / mieScaleHeight) * iStepSize;
+            iOd += vec2(odStepRlh, odStepMie);
+            vec2 od = iOd + lookUpOpticalDepth(iPos, sunPos);
+            vec3 attn = exp(-(mie * od.y + kRlh * od.x));
+            totalRlh += odStepRlh * attn;
+            totalMie += odStepMie * attn;
+        }
+        vec3 color = sunIntensity * (pRlh * kRlh * totalRlh + pMie * mie * totalMie);
+        return vec3(1.0f) - exp(-1.0f * color);
+    }
+
+    // Elevation is mapped by the square root of its angle on either side of
+    // the horizon, see skyViewUv in the shader
+    static vec2 skyViewUv(const vec3 &d) {
+        const float PI = 3.14159265f;
+        float azimuth = std::atan2(d.z, d.x);
+        float elevation = std::asin(std::clamp(d.y, -1.0f, 1.0f));
+        float v = 0.5f + 0.5f * (elevation < 0.0f ? -1.0f : 1.0f) *
+                             std::sqrt(std::abs(elevation) / (0.5f * PI));
+        return vec2(azimuth / (2.0f * PI) + 0.5f, v);
+    }
+    static vec3 skyViewDirection(const vec2 &uv) {
+        const float PI = 3.14159265f;
+        float azimuth = (uv.x - 0.5f) * 2.0f * PI;
+        float v = uv.y * 2.0f - 1.0f;
+        float elevation = (v < 0.0f ? -1.0f : 1.0f) * v * v * 0.5f * PI;
+        return vec3(std::cos(elevation) * std::cos(azimuth), std::sin(elevation),
+                    std::cos(elevation) * std::sin(azimuth));
+    }
+
+    static SkyLut build(const vec3 &sunPos) {
+        SkyLut sky;
+        sky.sunPos = sunPos;
+        sky.transmittance.resize(size_t(transmittanceWidth) * transmittanceHeight);
+        parallelFor(transmittanceHeight, [&](size_t y) {
+            float x = float(y) / (transmittanceHeight - 1);
+            float h = minHeight + x * x * (maxHeight - minHeight);
+            for (int i = 0; i < transmittanceWidth; i++) {
+                float m = float(i) / (transmittanceWidth - 1) * 2.0f - 1.0f;
+                float mu = (m < 0.0f ? -1.0f : 1.0f) * m * m;
+                sky.transmittance[y * transmittanceWidth + i] = logOpticalDepth(h, mu);
+            }
+        });
+        sky.skyView.resize(size_t(width) * height);
+        parallelFor(height, [&](size_t y) {
+            for (int x = 0; x < width; x++) {
+                vec2 uv((x + 0.5f) / width, (y + 0.5f) / height);
+                sky.skyView[y * width + x] =
+                    vec4(sky.radiance(skyViewDirection(uv)), 1.0f);
+            }
+        });
+        sky.sunRadiance = sky.radiance(sky.sunPos);
+        return sky;
+    }
+
+    // bilinear like GL_LINEAR, repeating in azimuth, clamped in elevation
+    vec3 sample(const vec3 &d) const {
+        vec2 uv = skyViewUv(normalize(d));
+        float u = uv.x * width - 0.5f;
+        float v = std::clamp(uv.y * height - 0.5f, 0.0f, float(height - 1));
+        int x0 = int(std::floor(u)), y0 = std::min(int(v), height - 2);
+        float fx = u - x0, fy = v - y0;
+        x0 = (x0 % width + width) % width;
+        int x1 = (x0 + 1) % width;
+        const vec4 *row0 = &skyView[size_t(y0) * width];
+        const vec4 *row1 = row0 + width;
+        vec4 c = (row0[x0] * (1.0f - fx) + row0[x1] * fx) * (1.0f - fy) +
+                 (row1[x0] * (1.0f - fx) + row1[x1] * fx) * fy;
+        return vec3(c);
+    }
+};
+
 struct Renderer {
     GLint program;
     GLuint VBO;
-    GLuint seed;
     std::shared_ptr<World> world;
     mat4 cameraDirection, cameraOrigin;
     GLuint sample;   // texture for 1 spp
@@ -502,19 +2221,28 @@ struct Renderer {
     vec2 eulerAngle = vec2(0, 0);
     bool needRedraw = true;
     uint32_t options = ENABLE_ATMOSPHERE_SCATTERING;
+    SkyLut sky; // for the sun of the last pass
+    GLuint skyViewTexture = 0;
+    // trace a VoxelDag instead of the brick map, set before compileShader
+    bool useDag = false;
     float orbitDistance = 2.5f;
+    ivec2 resolution = ivec2(1280, 720);
     std::chrono::time_point<std::chrono::high_resolution_clock> lastRenderTime;
     enum CameraMode { Free, Orbit };
 
     CameraMode cameraMode = Free;
 
-    explicit Renderer() {}
+    // the camera is kept by setUpWorld, headless renders place it first
+    explicit Renderer()
+        : cameraDirection(identity<mat4>()),
+          cameraOrigin(translate(vec3(20, 20, -20))) {}
 
     void compileShader() {
         std::vector<char> error(4096, 0);
         auto shader = glCreateShader(GL_COMPUTE_SHADER);
         GLint success;
-        const char *version = "#version 430\n";
+        const char *version = useDag ? "#version 430\n#define USE_DAG\n"
+                                     : "#version 430\n";
         const char *src[] = {version, commondDefsSource, externalShaderSource,
                              bsdfSource, computeShaderSource};
         glShaderSource(shader, sizeof(src) / sizeof(src[0]), src, nullptr);
@@ -537,222 +2265,1999 @@ struct Renderer {
                       << error.data() << std::endl;
             exit(1);
         }
-        glDeleteShader(shader);
-        std::cout << "Shader compiled without complaint" << std::endl;
-
-        glGenTextures(1, &sample);
-        glBindTexture(GL_TEXTURE_2D, sample);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1280, 720, 0, GL_RGBA, GL_FLOAT,
-                     NULL);
+        glDeleteShader(shader);
+        std::cout << "Shader compiled without complaint" << std::endl;
+
+        glGenTextures(1, &sample);
+        glBindTexture(GL_TEXTURE_2D, sample);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, resolution.x, resolution.y, 0,
+                     GL_RGBA, GL_FLOAT, NULL);
+
+        glGenTextures(1, &accum);
+        glBindTexture(GL_TEXTURE_2D, accum);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, resolution.x, resolution.y,
+                     0, GL_RGBA, GL_FLOAT, NULL);
+
+        glGenTextures(1, &composed);
+        glBindTexture(GL_TEXTURE_2D, composed);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, resolution.x, resolution.y,
+                     0, GL_RGBA, GL_FLOAT, NULL);
+    }
+
+    void setUpWorld() {
+        if (world->octree.empty()) {
+            world->buildOctree();
+        }
+        world->useDag = useDag;
+        world->setUpTexture();
+    }
+
+    void render(GLFWwindow *window) {
+        {
+            double xpos, ypos;
+            auto &io = ImGui::GetIO();
+            xpos = io.MousePos.x;
+            ypos = io.MousePos.y;
+
+            auto windowPos = ImGui::GetWindowPos();
+            auto size = ImGui::GetWindowSize();
+
+            auto pos = io.MousePos;
+            bool pressed = io.MouseDown[1];
+            bool inside =
+                (pos.x >= windowPos.x && pos.y >= windowPos.y &&
+                 pos.x < windowPos.x + size.x && pos.y < windowPos.y + size.y);
+            if (io.MouseWheel != 0 && inside && cameraMode == Orbit) {
+                iTime = 0;
+                if (io.MouseWheel < 0) {
+                    orbitDistance *= 1.1;
+                } else {
+                    orbitDistance *= 0.9;
+                }
+            }
+            if (pressed && inside) {
+                if (!prevMouseDown) {
+                    mousePos = ivec2(xpos, ypos);
+                    if (mousePos != prevMousePos) {
+                        iTime = 0;
+                    }
+                }
+                auto p = ivec2(xpos, ypos);
+                if (lastFrameMousePos != p) {
+                    iTime = 0;
+                    auto rot = (vec2(p) - vec2(lastFrameMousePos)) / 300.0f *
+                               float(M_PI);
+                    eulerAngle += rot;
+                }
+
+            } else {
+                if (prevMouseDown) {
+                    prevMousePos = lastFrameMousePos;
+                }
+            }
+            auto M = rotate(eulerAngle.x, vec3(0, 1, 0));
+            M *= rotate(eulerAngle.y, vec3(1, 0, 0));
+
+            std::chrono::duration<double> elapsed =
+                std::chrono::high_resolution_clock::now() - lastRenderTime;
+
+            if (cameraMode == Orbit) {
+                updateOrbitCamera();
+            } else if (elapsed.count() > 1.0 / 30.0) {
+                lastRenderTime = std::chrono::high_resolution_clock::now();
+                // free
+                float vel = 6.0f;
+                float step = vel / 30.0;
+                vec3 o = cameraOrigin * vec4(0, 0, 0, 1);
+                auto R = rotate(eulerAngle.x, vec3(0, 1, 0));
+                if (io.KeyShift) {
+                    step *= 10.0f;
+                }
+                if (io.KeysDown['A']) {
+                    o += vec3(step * R * vec4(-1, 0, 0, 1));
+                    iTime = 0;
+                }
+                if (io.KeysDown['D']) {
+                    o += vec3(step * R * vec4(1, 0, 0, 1));
+                    iTime = 0;
+                }
+                if (io.KeysDown['W']) {
+                    o += vec3(step * R * vec4(0, 0, 1, 1));
+                    iTime = 0;
+                }
+                if (io.KeysDown['S']) {
+                    o += vec3(step * R * vec4(0, 0, -1, 1));
+                    iTime = 0;
+                }
+                if (io.KeyCtrl) {
+                    o += vec3(step * R * vec4(0, -1, 0, 1));
+                    iTime = 0;
+                }
+                if (io.KeysDown[' ']) {
+                    o += vec3(step * R * vec4(0, 1, 0, 1));
+                    iTime = 0;
+                }
+                cameraOrigin = translate(o);
+                cameraDirection = M;
+            }
+            prevMouseDown = pressed;
+            lastFrameMousePos = ivec2(xpos, ypos);
+        }
+        renderPass();
+    }
+
+    void updateOrbitCamera() {
+        auto M = rotate(eulerAngle.x, vec3(0, 1, 0));
+        M *= rotate(eulerAngle.y, vec3(1, 0, 0));
+        auto tr = vec3(world->worldDimension) * 0.5f;
+        tr.z *= -1.0f;
+        cameraDirection = M;
+        cameraOrigin = translate(vec3(tr.x, tr.y, -tr.z)) * cameraDirection *
+                       translate(vec3(0, 0, orbitDistance * tr.z));
+    }
+
+    void setFreeCamera(const vec3 &origin) {
+        cameraMode = Free;
+        cameraOrigin = translate(origin);
+        cameraDirection = rotate(eulerAngle.x, vec3(0, 1, 0)) *
+                          rotate(eulerAngle.y, vec3(1, 0, 0));
+    }
+
+    vec3 cameraPosition() const { return vec3(cameraOrigin * vec4(0, 0, 0, 1)); }
+    vec3 cameraForward() const {
+        return vec3(cameraDirection * vec4(0, 0, 1, 0));
+    }
+
+    vec3 sunDirection() const {
+        float theta = (world->sunHeight - M_PI_2);
+        float phi = world->sunPhi;
+        return normalize(
+            vec3(cos(phi) * sin(theta), cos(theta), sin(phi) * sin(theta)));
+    }
+
+    // Rebuilds the sky tables and uploads the sky view when the sun moved
+    void updateSky(const vec3 &sunPos) {
+        if (skyViewTexture && sky.sunPos == sunPos) {
+            return;
+        }
+        sky = SkyLut::build(sunPos);
+        if (!skyViewTexture) {
+            glGenTextures(1, &skyViewTexture);
+            glBindTexture(GL_TEXTURE_2D, skyViewTexture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+        glBindTexture(GL_TEXTURE_2D, skyViewTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, SkyLut::width,
+                     SkyLut::height, 0, GL_RGBA, GL_FLOAT, sky.skyView.data());
+    }
+
+    // Dispatches one sample per pixel, accumulating into accum
+    void renderPass() {
+        if (needRedraw) {
+            iTime = 0;
+        }
+        vec3 sunPos = sunDirection();
+        updateSky(sunPos);
+        int w = resolution.x, h = resolution.y;
+        glUseProgram(program);
+        glBindTexture(GL_TEXTURE_2D, accum);
+        glBindImageTexture(1, accum, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+        glBindTexture(GL_TEXTURE_2D, composed);
+        glBindImageTexture(3, composed, 0, GL_FALSE, 0, GL_WRITE_ONLY,
+                           GL_RGBA32F);
+        glUniform1i(glGetUniformLocation(program, "octreeRoot"),
+                    world->octreeRoot);
+        glUniform3i(glGetUniformLocation(program, "brickGridDimension"),
+                    world->voxels.gridDimension.x,
+                    world->voxels.gridDimension.y,
+                    world->voxels.gridDimension.z);
+        glUniform1ui(glGetUniformLocation(program, "dagRoot"), world->dagRoot);
+        glUniform1i(glGetUniformLocation(program, "dagLevels"), world->dagLevels);
+        // the 64-tree is built the first time it is traced
+        if ((options & USE_TREE64) && world->tree64Levels == 0) {
+            world->uploadTree64();
+        }
+        glUniform1i(glGetUniformLocation(program, "tree64Levels"),
+                    world->tree64Levels);
+        glUniform1f(glGetUniformLocation(program, "maxRayIntensity"),
+                    maxRayIntensity);
+        glUniform2f(glGetUniformLocation(program, "iResolution"), w, h);
+        glUniform3i(glGetUniformLocation(program, "worldDimension"),
+                    world->worldDimension.x, world->worldDimension.y,
+                    world->worldDimension.z);
+        glUniform1i(glGetUniformLocation(program, "iTime"), iTime++);
+        glUniform1ui(glGetUniformLocation(program, "options"), options);
+        glUniform1i(glGetUniformLocation(program, "maxDepth"), maxDepth);
+        glUniformMatrix4fv(glGetUniformLocation(program, "cameraOrigin"), 1,
+                           GL_FALSE, &cameraOrigin[0][0]);
+        glUniformMatrix4fv(glGetUniformLocation(program, "cameraDirection"), 1,
+                           GL_FALSE, &cameraDirection[0][0]);
+        glUniform3fv(glGetUniformLocation(program, "sunPos"), 1,
+                     (float *)&sunPos);
+        vec3 sunRadiance = (options & ENABLE_ATMOSPHERE_SCATTERING)
+                               ? sky.sunRadiance
+                               : vec3(0);
+        glUniform3fv(glGetUniformLocation(program, "sunRadiance"), 1,
+                     (float *)&sunRadiance);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, world->materialsSSBO);
+        if (needRedraw) {
+            // printf("redraw\n");
+
+            GLvoid *p = glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_WRITE_ONLY);
+            memcpy(p, world->materials.get(), sizeof(World::Materials));
+            glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+        }
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, world->materialsSSBO);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, world->octreeBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, world->brickGridBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, world->brickPoolBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, world->tree64Buffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, world->occupancyBuffer);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_3D, world->emptyDistanceTexture);
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, skyViewTexture);
+        glActiveTexture(GL_TEXTURE0);
+        glUniform1i(glGetUniformLocation(program, "emptyDistance"), 1);
+        glUniform1i(glGetUniformLocation(program, "skyView"), 2);
+        glDispatchCompute((w + 15) / 16, (h + 15) / 16, 1);
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        glFinish();
+        if (iTime % 200 == 0)
+            printf("pass = %d\n", iTime);
+        needRedraw = false;
+    }
+
+    // Mean radiance per pixel, RGBA, top row first
+    std::vector<float> readAccumulated() {
+        std::vector<float> image(size_t(resolution.x) * resolution.y * 4);
+        glBindTexture(GL_TEXTURE_2D, accum);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, image.data());
+        for (size_t i = 0; i < image.size(); i += 4) {
+            float n = std::max(image[i + 3], 1.0f);
+            image[i] /= n;
+            image[i + 1] /= n;
+            image[i + 2] /= n;
+            image[i + 3] = 1.0f;
+        }
+        return image;
+    }
+};
+
+// C++ port of computeShaderSource for machines without a GPU, and a
+// reference for the GLSL kernel. Functions mirror the shader one to one and
+// read the same World data (brick map and compact octree), so both backends
+// converge to the same image. Pixels are rendered in 16x16 tiles, the
+// shader's work group size, spread over all cores.
+struct CpuRenderer {
+    struct Material {
+        vec3 emission;
+        vec3 baseColor;
+        float roughness;
+        float metallic;
+    };
+    struct Intersection {
+        float t;
+        vec3 n;
+        vec3 p;
+        Material mat;
+    };
+    struct Sampler {
+        int dimension;
+        uint32_t index; // iTime
+        uint32_t seed;  // hash of the pixel
+    };
+    struct LocalFrame {
+        vec3 N, T, B;
+    };
+    static constexpr float RayBias = 1e-3f;
+    static constexpr int tileSize = 16;
+
+    const World &world;
+    ivec2 resolution;
+    mat4 cameraOrigin, cameraDirection;
+    vec3 sunPos;
+    SkyLut sky;
+    vec3 sunRadiance; // LiBackground towards the sun, constant for a pass
+    uint32_t options;
+    int maxDepth;
+    float maxRayIntensity;
+    int iTime = 0;
+    std::vector<vec4> accum;
+
+    // Takes the camera, sun and settings of a (not GL initialized) Renderer
+    explicit CpuRenderer(const Renderer &renderer)
+        : world(*renderer.world), resolution(renderer.resolution),
+          cameraOrigin(renderer.cameraOrigin),
+          cameraDirection(renderer.cameraDirection),
+          sunPos(renderer.sunDirection()), options(renderer.options),
+          maxDepth(renderer.maxDepth),
+          maxRayIntensity(renderer.maxRayIntensity) {
+        size_t n = size_t(resolution.x) * resolution.y;
+        accum.assign(n, vec4(0));
+        sky = SkyLut::build(sunPos);
+        sunRadiance = (options & ENABLE_ATMOSPHERE_SCATTERING) ? sky.sunRadiance
+                                                               : vec3(0);
+    }
+
+    static float maxComp(const vec3 &o) { return std::max(std::max(o.x, o.y), o.z); }
+    static float minComp(const vec3 &o) { return std::min(std::min(o.x, o.y), o.z); }
+    static bool fleq(float x, float y) { return std::abs(x - y) < 0.001f; }
+
+    static float intersectBox(const vec3 &o, const vec3 &d, const vec3 &p1,
+                              const vec3 &p2) {
+        vec3 t0 = (p1 - o) / d;
+        vec3 t1 = (p2 - o) / d;
+        vec3 tmin = min(t0, t1);
+        vec3 tmax = max(t0, t1);
+        float t = maxComp(tmin);
+        if (t < minComp(tmax)) {
+            t = std::max(t, 0.0f);
+            if (t > minComp(tmax)) {
+                return -1.0f;
+            }
+            return t;
+        }
+        return -1.0f;
+    }
+    static float intersectBox(const vec3 &o, const vec3 &d, const vec3 &p1,
+                              const vec3 &p2, vec3 &n) {
+        vec3 t0 = (p1 - o) / d;
+        vec3 t1 = (p2 - o) / d;
+        vec3 tmin = min(t0, t1);
+        vec3 tmax = max(t0, t1);
+        float t = maxComp(tmin);
+        if (t < minComp(tmax)) {
+            t = std::max(t, 0.0f);
+            if (t > minComp(tmax)) {
+                return -1.0f;
+            }
+            vec3 p = o + t * d;
+            if (fleq(p1.x, p.x)) {
+                n = vec3(-1, 0, 0);
+            } else if (fleq(p2.x, p.x)) {
+                n = vec3(1, 0, 0);
+            } else if (fleq(p1.y, p.y)) {
+                n = vec3(0, -1, 0);
+            } else if (fleq(p2.y, p.y)) {
+                n = vec3(0, 1, 0);
+            } else if (fleq(p1.z, p.z)) {
+                n = vec3(0, 0, -1);
+            } else {
+                n = vec3(0, 0, 1);
+            }
+            return t;
+        }
+        return -1.0f;
+    }
+    static bool insideBox(const vec3 &p, const ivec3 &pmin, const ivec3 &pmax) {
+        return all(lessThanEqual(p, vec3(pmax) + vec3(1))) &&
+               all(greaterThanEqual(p, vec3(pmin) - vec3(1)));
+    }
+    int map(const vec3 &p) const {
+        ivec3 v = ivec3(p);
+        if (any(lessThan(v, ivec3(0))) ||
+            any(greaterThanEqual(v, world.worldDimension))) {
+            return 0;
+        }
+        return world.voxels.get(v);
+    }
+    Material material(int mat) const {
+        const auto &m = *world.materials;
+        Material result;
+        result.baseColor = vec3(m.MaterialBaseColor[mat]);
+        result.emission =
+            vec3(m.MaterialEmission[mat]) * m.MaterialEmissionStrength[mat];
+        result.roughness = m.MaterialRoughness[mat] * m.MaterialRoughness[mat];
+        result.metallic = m.MaterialMetallic[mat];
+        return result;
+    }
+
+    // DDA through the voxels of one leaf (USE_BRANCHLESS_DDA)
+    bool intersect1(vec3 ro, const vec3 &rd, const ivec3 &pmin,
+                    const ivec3 &pmax, Intersection &isct) const {
+        vec3 n;
+        float distance = intersectBox(ro, rd, vec3(pmin), vec3(pmax), n);
+        if (distance < 0.0f) {
+            return false;
+        }
+        ro += distance * rd;
+        vec3 p0 = ro;
+        vec3 p = floor(p0);
+        vec3 stp = sign(rd);
+        vec3 invd = clamp(vec3(1) / rd, vec3(-1e10f), vec3(1e10f));
+        vec3 tMax = abs((p + max(stp, vec3(0)) - p0) * invd);
+        vec3 delta = abs(invd);
+        isct.n = n;
+        vec3 mask = vec3(0);
+        float t = 0;
+        ivec3 extent = pmax - pmin;
+        int maxIter = extent.x + extent.y + extent.z;
+        for (int i = 0; i < maxIter; ++i) {
+            if (!insideBox(p, pmin - ivec3(1), pmax + ivec3(1))) {
+                break;
+            }
+            int mat = map(p);
+            if (mat > 0 && t >= RayBias) {
+                isct.p = p0 + rd * t;
+                isct.t = distance + t;
+                isct.n = -sign(rd) * mask;
+                isct.mat = material(mat);
+                return true;
+            }
+            // step(tMax.xyz, tMax.yxy) * step(tMax.xyz, tMax.zzx)
+            mask = vec3(tMax.y >= tMax.x && tMax.z >= tMax.x,
+                        tMax.x >= tMax.y && tMax.z >= tMax.y,
+                        tMax.y >= tMax.z && tMax.x >= tMax.z);
+            p += stp * mask;
+            t = dot(tMax, mask);
+            tMax += delta * mask;
+        }
+        return false;
+    }
+
+    // Child mask with bit k for slot k ^ octant, see rayOrder in the shader
+    static uint32_t rayOrder(uint32_t childMask, uint32_t octant) {
+        if (octant & 1) {
+            childMask = (childMask & 0x55u) << 1 | (childMask >> 1 & 0x55u);
+        }
+        if (octant & 2) {
+            childMask = (childMask & 0x33u) << 2 | (childMask >> 2 & 0x33u);
+        }
+        if (octant & 4) {
+            childMask = (childMask & 0x0fu) << 4 | (childMask >> 4 & 0x0fu);
+        }
+        return childMask;
+    }
+    static int popcount(uint32_t x) {
+        int n = 0;
+        for (; x; x &= x - 1) {
+            n++;
+        }
+        return n;
+    }
+    // Stackless octree traversal shared by intersect2 and occlude, see
+    // traverseOctree in the shader. Returns at the first hit when anyHit is
+    // set.
+    bool traverse(const vec3 &ro, const vec3 &rd, Intersection &isct,
+                  bool anyHit) const {
+        if (world.octreeRoot < 0) {
+            return false;
+        }
+        bool hit = false;
+        uint32_t octant = uint32_t(rd.x < 0.0f) | uint32_t(rd.y < 0.0f) << 1 |
+                          uint32_t(rd.z < 0.0f) << 2;
+        const uint32_t root = uint32_t(world.octreeRoot);
+        uint32_t current = root;
+        const OctreeNode *node = &world.octree[current];
+        const OctreeNode *parent = nullptr;
+        ivec3 parentMin = ivec3(0);
+        for (;;) {
+            ivec3 nodeMin = node->pmin(parentMin);
+            ivec3 pmin = nodeMin - ivec3(1);
+            ivec3 pmax = node->pmax(parentMin) + ivec3(1);
+            float t = intersectBox(ro, rd, vec3(pmin), vec3(pmax));
+            if (t >= 0.0f && t <= isct.t) {
+                if (node->isLeaf()) {
+                    Intersection tmp;
+                    tmp.t = isct.t;
+                    if (intersect1(ro, rd, pmin, pmax, tmp) && tmp.t < isct.t) {
+                        isct = tmp;
+                        hit = true;
+                        if (anyHit) {
+                            return true;
+                        }
+                    }
+                } else {
+                    uint32_t childMask = node->childMask();
+                    uint32_t slot =
+                        uint32_t(countTrailingZeros(rayOrder(childMask, octant))) ^ octant;
+                    parent = node;
+                    parentMin = nodeMin;
+                    current = node->firstChild +
+                              popcount(childMask & ((1u << slot) - 1u));
+                    node = &world.octree[current];
+                    continue;
+                }
+            }
+            for (;;) {
+                if (current == root) {
+                    return hit;
+                }
+                uint32_t childMask = parent->childMask();
+                uint32_t k = uint32_t(node->slot()) ^ octant;
+                uint32_t later = rayOrder(childMask, octant) & (0xfeu << k);
+                if (later) {
+                    uint32_t slot = uint32_t(countTrailingZeros(later)) ^ octant;
+                    current = parent->firstChild +
+                              popcount(childMask & ((1u << slot) - 1u));
+                    node = &world.octree[current];
+                    break;
+                }
+                current = node->parent;
+                node = parent;
+                // parentMin was the pmin of node, now that of its parent
+                parentMin -= node->pmin(ivec3(0));
+                if (current != root) {
+                    parent = &world.octree[node->parent];
+                }
+            }
+        }
+    }
+    bool occlude(const vec3 &ro, const vec3 &rd) const {
+        Intersection isct;
+        isct.t = 1e8f;
+        return traverse(ro, rd, isct, true);
+    }
+    bool intersect(const vec3 &ro, const vec3 &rd, Intersection &isct) const {
+        isct.t = 1e8f;
+        return traverse(ro, rd, isct, false);
+    }
+
+    // Owen-scrambled Sobol points, see nextFloat2 in the shader
+    static uint32_t hashUint(uint32_t x) {
+        x ^= x >> 16;
+        x *= 0x7feb352du;
+        x ^= x >> 15;
+        x *= 0x846ca68bu;
+        x ^= x >> 16;
+        return x;
+    }
+    static uint32_t bitfieldReverse(uint32_t x) {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+        x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+    static uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed) {
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return x;
+    }
+    static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+        return bitfieldReverse(laineKarrasPermutation(bitfieldReverse(x), seed));
+    }
+    static uvec2 sobol2(uint32_t index) {
+        uint32_t x = bitfieldReverse(index);
+        uint32_t y = 0;
+        for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+            if (index & 1u)
+                y ^= v;
+        }
+        return uvec2(x, y);
+    }
+    static Sampler makeSampler(const ivec2 &pixelCoord, int index) {
+        Sampler sampler;
+        sampler.dimension = 0;
+        sampler.index = uint32_t(index);
+        sampler.seed = hashUint(uint32_t(pixelCoord.x) ^ hashUint(uint32_t(pixelCoord.y)));
+        return sampler;
+    }
+    static vec2 nextFloat2(Sampler &sampler) {
+        uint32_t seed = hashUint(sampler.seed + uint32_t(sampler.dimension) * 0x9e3779b9u);
+        sampler.dimension++;
+        uvec2 p = sobol2(nestedUniformScramble(sampler.index, seed));
+        p.x = nestedUniformScramble(p.x, hashUint(seed ^ 0x68bc21ebu));
+        p.y = nestedUniformScramble(p.y, hashUint(seed ^ 0x02e5be93u));
+        return vec2(float(p.x >> 8), float(p.y >> 8)) * (1.0f / 16777216.0f);
+    }
+    static float nextFloat(Sampler &sampler) { return nextFloat2(sampler).x; }
+    static void computeLocalFrame(const vec3 &N, LocalFrame &frame) {
+        frame.N = N;
+        if (std::abs(N.x) > std::abs(N.y)) {
+            frame.T = vec3(-N.z, 0.0f, N.x) / std::sqrt(N.z * N.z + N.x * N.x);
+        } else {
+            frame.T = vec3(0.0f, -N.z, N.y) / std::sqrt(N.z * N.z + N.y * N.y);
+        }
+        frame.B = normalize(cross(N, frame.T));
+    }
+    static vec3 worldToLocal(const vec3 &v, const LocalFrame &frame) {
+        return vec3(dot(v, frame.T), dot(v, frame.N), dot(v, frame.B));
+    }
+    static vec3 localToWorld(const vec3 &v, const LocalFrame &frame) {
+        return v.x * frame.T + v.y * frame.N + v.z * frame.B;
+    }
+    static vec2 diskSampling(vec2 u) {
+        float r = std::sqrt(u.x);
+        float t = u.y * 2.0f * float(M_PI);
+        return vec2(r * std::cos(t), r * std::sin(t));
+    }
+    static vec3 cosineHemisphereSampling(const vec2 &u) {
+        vec2 d = diskSampling(u);
+        float h = 1.0f - dot(d, d);
+        return vec3(d.x, std::sqrt(h), d.y);
+    }
+
+    // externalShaderSource
+    vec3 LiBackground(const vec3 & /*o*/, const vec3 &d) const {
+        if (0 != (options & ENABLE_ATMOSPHERE_SCATTERING)) {
+            return sky.sample(d);
+        }
+        return vec3(0);
+    }
+
+    // bsdfSource
+    static float AbsCosTheta(const vec3 &w) { return std::abs(w.y); }
+    static float Cos2Theta(const vec3 &w) { return w.y * w.y; }
+    static float Sin2Theta(const vec3 &w) {
+        return std::max(0.0f, 1.0f - Cos2Theta(w));
+    }
+    static float Tan2Theta(const vec3 &w) { return Sin2Theta(w) / Cos2Theta(w); }
+    static float SchlickWeight(float cosTheta) {
+        float m = std::clamp(1.0f - cosTheta, 0.0f, 1.0f);
+        return (m * m) * (m * m) * m;
+    }
+    static float Schlick(float R0, float cosTheta) {
+        return mix(R0, 1.0f, SchlickWeight(cosTheta));
+    }
+    static float GGX_D(float alpha, const vec3 &m) {
+        if (m.y <= 0.0f)
+            return 0.0f;
+        float a2 = alpha * alpha;
+        float c2 = Cos2Theta(m);
+        float t2 = Tan2Theta(m);
+        float at = (a2 + t2);
+        return a2 / (float(M_PI) * c2 * c2 * at * at);
+    }
+    static float GGX_G1(float alpha, const vec3 &v, const vec3 &m) {
+        if (dot(v, m) * v.y <= 0.0f) {
+            return 0.0f;
+        }
+        return 2.0f / (1.0f + std::sqrt(1.0f + alpha * alpha * Tan2Theta(m)));
+    }
+    static float GGX_G(float alpha, const vec3 &i, const vec3 &o,
+                       const vec3 &m) {
+        return GGX_G1(alpha, i, m) * GGX_G1(alpha, o, m);
+    }
+    static vec3 GGX_SampleWh(float alpha, const vec2 &u) {
+        float phi = 2.0f * float(M_PI) * u.y;
+        float t2 = alpha * alpha * u.x / (1.0f - u.x);
+        float cosTheta = 1.0f / std::sqrt(1.0f + t2);
+        float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+        return vec3(std::cos(phi) * sinTheta, cosTheta,
+                    std::sin(phi) * sinTheta);
+    }
+    static float GGX_EvaluatePdf(float alpha, const vec3 &wh) {
+        return GGX_D(alpha, wh) * AbsCosTheta(wh);
+    }
+    static vec3 evaluateGlossy(const vec3 &R, float alpha, const vec3 &wo,
+                               const vec3 &wi) {
+        if (wo.y * wi.y <= 0.0f) {
+            return vec3(0);
+        }
+        float cosThetaO = AbsCosTheta(wo);
+        float cosThetaI = AbsCosTheta(wi);
+        vec3 wh = (wo + wi);
+        if (cosThetaI == 0 || cosThetaO == 0)
+            return vec3(0);
+        if (wh.x == 0 && wh.y == 0 && wh.z == 0)
+            return vec3(0);
+        wh = normalize(wh);
+        float F = Schlick(0.4f, std::abs(dot(wi, wh)));
+        return max(vec3(0), R * F * GGX_D(alpha, wh) *
+                                GGX_G(alpha, wo, wi, wh) /
+                                (4.0f * cosThetaI * cosThetaO));
+    }
+    static float evaluateGlossyPdf(float alpha, const vec3 &wo,
+                                   const vec3 &wi) {
+        if (wo.y * wi.y <= 0.0f) {
+            return 0.0f;
+        }
+        vec3 wh = normalize(wi + wo);
+        return GGX_EvaluatePdf(alpha, wh) / (4.0f * dot(wo, wh));
+    }
+    static vec3 evaluateDiffuse(const vec3 &R, const vec3 &wo, const vec3 &wi) {
+        if (wo.y * wi.y <= 0.0f) {
+            return vec3(0);
+        }
+        return R * float(M_1_PI);
+    }
+    static float evaluateDiffusePdf(const vec3 & /*wo*/, const vec3 &wi) {
+        return AbsCosTheta(wi) * float(M_1_PI);
+    }
+    static vec3 evaluateBSDF(const Material &mat, const vec3 &wo,
+                             const vec3 &wi) {
+        return mix(evaluateDiffuse(mat.baseColor, wo, wi),
+                   evaluateGlossy(mat.baseColor, mat.roughness, wo, wi),
+                   mat.metallic);
+    }
+    static float evaluatePdf(const Material &mat, const vec3 &wo,
+                             const vec3 &wi) {
+        return mix(evaluateDiffusePdf(wo, wi),
+                   evaluateGlossyPdf(mat.roughness, wo, wi), mat.metallic);
+    }
+    static vec3 sampleBSDF(vec2 u, const Material &mat, const vec3 &wo,
+                           vec3 &wi, float &pdf) {
+        float metallic = mat.metallic;
+        if (u.x < metallic) {
+            u.x /= metallic;
+            wi = reflect(-wo, GGX_SampleWh(mat.roughness, u));
+        } else {
+            u.x = (u.x - metallic) / (1.0f - metallic);
+            wi = cosineHemisphereSampling(u);
+            if (wi.y * wo.y < 0.0f) {
+                wi.y = -wi.y;
+            }
+        }
+        pdf = evaluatePdf(mat, wo, wi);
+        return evaluateBSDF(mat, wo, wi);
+    }
+
+    vec3 directLighting(const LocalFrame &frame, const Intersection &isct,
+                        const vec3 &wo) const {
+        vec3 lightDir = sunPos;
+        vec3 wi = worldToLocal(lightDir, frame);
+        vec3 f = evaluateBSDF(isct.mat, wo, wi);
+        if (any(greaterThan(f, vec3(0))) && !occlude(isct.p, lightDir)) {
+            return sunRadiance * f * AbsCosTheta(wi);
+        }
+        return vec3(0);
+    }
+    vec3 Li(vec3 o, vec3 d, Sampler &sampler) const {
+        Intersection isct;
+        vec3 L = vec3(0);
+        vec3 beta = vec3(1);
+        for (int depth = 0; depth < maxDepth; depth++) {
+            if (!intersect(o, d, isct)) {
+                L += beta * LiBackground(o, d);
+                break;
+            }
+            L += beta * isct.mat.emission;
+            LocalFrame frame;
+            computeLocalFrame(isct.n, frame);
+            vec3 wo = worldToLocal(-d, frame);
+            L += beta * directLighting(frame, isct, wo);
+            vec3 wi;
+            float pdf;
+            vec3 f = sampleBSDF(nextFloat2(sampler), isct.mat, wo, wi, pdf);
+            wi = normalize(localToWorld(wi, frame));
+
+            o = isct.p;
+            d = wi;
+            beta *= f * std::abs(dot(isct.n, wi)) / pdf;
+            float p = maxComp(beta);
+            if (nextFloat(sampler) > p) {
+                break;
+            } else {
+                beta /= p;
+            }
+        }
+        return L;
+    }
+
+    // The shader's main() for one pixel
+    void renderPixel(const ivec2 &pixelCoord) {
+        size_t index = size_t(pixelCoord.y) * resolution.x + pixelCoord.x;
+        Sampler sampler = makeSampler(pixelCoord, iTime);
+        vec2 iResolution = vec2(resolution);
+        vec2 uv = (vec2(pixelCoord) + nextFloat2(sampler)) / iResolution;
+
+        uv = 2.0f * uv - vec2(1.0f);
+        uv.y *= -1.0f;
+        uv.x *= iResolution.x / iResolution.y;
+        vec4 _o = (cameraOrigin * vec4(vec3(0), 1));
+        vec3 o = vec3(_o) / _o.w;
+        float fov = 60.0f / 180.0f * float(M_PI);
+        float z = 1.0f / std::tan(fov / 2.0f);
+        vec3 d = normalize(mat3(cameraDirection) * normalize(vec3(uv, z)));
+        vec3 L = Li(o, d, sampler);
+        for (int i = 0; i < 3; i++) {
+            L[i] = std::isnan(L[i]) ? 0.0f : std::clamp(L[i], 0.0f, maxRayIntensity);
+        }
+        vec4 color = vec4(L, 1.0f);
+        if (iTime > 0)
+            color += accum[index];
+        accum[index] = color;
+    }
+
+    void renderPass() {
+        ivec2 tiles = (resolution + ivec2(tileSize - 1)) / tileSize;
+        parallelFor(size_t(tiles.x) * tiles.y, [&](size_t tile) {
+            ivec2 begin = ivec2(int(tile % tiles.x), int(tile / tiles.x)) * tileSize;
+            ivec2 end = min(begin + ivec2(tileSize), resolution);
+            for (int y = begin.y; y < end.y; y++) {
+                for (int x = begin.x; x < end.x; x++) {
+                    renderPixel(ivec2(x, y));
+                }
+            }
+        });
+        iTime++;
+    }
+
+    // Same layout as Renderer::readAccumulated
+    std::vector<float> readAccumulated() const {
+        std::vector<float> image(accum.size() * 4);
+        for (size_t i = 0; i < accum.size(); i++) {
+            float n = std::max(accum[i].w, 1.0f);
+            image[i * 4] = accum[i].x / n;
+            image[i * 4 + 1] = accum[i].y / n;
+            image[i * 4 + 2] = accum[i].z / n;
+            image[i * 4 + 3] = 1.0f;
+        }
+        return image;
+    }
+};
+
+// Writes linear RGBA as an 8 bit PNG, gamma corrected like the view
+bool writePNG(const std::string &filename, int w, int h,
+              const std::vector<float> &image) {
+    std::vector<uint8_t> pixels(size_t(w) * h * 3);
+    for (size_t i = 0; i < size_t(w) * h; i++) {
+        for (int c = 0; c < 3; c++) {
+            float v = std::pow(std::max(image[i * 4 + c], 0.0f), 1.0f / 2.2f);
+            pixels[i * 3 + c] = (uint8_t)std::min(255.0f, v * 255.0f + 0.5f);
+        }
+    }
+    size_t size = 0;
+    void *png = tdefl_write_image_to_png_file_in_memory(pixels.data(), w, h, 3,
+                                                        &size);
+    if (!png) {
+        return false;
+    }
+    FILE *f = fopen(filename.c_str(), "wb");
+    bool ok = f && fwrite(png, 1, size, f) == size;
+    if (f) {
+        ok = fclose(f) == 0 && ok;
+    }
+    mz_free(png);
+    return ok;
+}
+
+// Writes linear RGB as an uncompressed scanline OpenEXR with float channels
+bool writeEXR(const std::string &filename, int w, int h,
+              const std::vector<float> &image) {
+    std::vector<uint8_t> out;
+    auto put = [&](const void *p, size_t n) {
+        out.insert(out.end(), (const uint8_t *)p, (const uint8_t *)p + n);
+    };
+    auto putInt = [&](int32_t x) { put(&x, 4); };
+    auto putFloat = [&](float x) { put(&x, 4); };
+    auto attribute = [&](const char *name, const char *type, int32_t size) {
+        put(name, strlen(name) + 1);
+        put(type, strlen(type) + 1);
+        putInt(size);
+    };
+    const uint8_t magic[] = {0x76, 0x2f, 0x31, 0x01};
+    put(magic, 4);
+    putInt(2); // version 2, single part scanline
+    // channels are stored in alphabetical order
+    const char *channels[] = {"B", "G", "R"};
+    attribute("channels", "chlist", 3 * (2 + 16) + 1);
+    for (auto c : channels) {
+        put(c, 2);
+        putInt(2); // FLOAT
+        putInt(0); // pLinear and reserved
+        putInt(1); // x sampling
+        putInt(1); // y sampling
+    }
+    out.push_back(0);
+    attribute("compression", "compression", 1);
+    out.push_back(0); // NO_COMPRESSION
+    for (auto name : {"dataWindow", "displayWindow"}) {
+        attribute(name, "box2i", 16);
+        putInt(0);
+        putInt(0);
+        putInt(w - 1);
+        putInt(h - 1);
+    }
+    attribute("lineOrder", "lineOrder", 1);
+    out.push_back(0); // INCREASING_Y
+    attribute("pixelAspectRatio", "float", 4);
+    putFloat(1.0f);
+    attribute("screenWindowCenter", "v2f", 8);
+    putFloat(0.0f);
+    putFloat(0.0f);
+    attribute("screenWindowWidth", "float", 4);
+    putFloat(1.0f);
+    out.push_back(0);
+
+    const uint64_t lineSize = 8 + uint64_t(w) * 3 * 4;
+    uint64_t offset = out.size() + uint64_t(h) * 8;
+    for (int y = 0; y < h; y++) {
+        put(&offset, 8);
+        offset += lineSize;
+    }
+    for (int y = 0; y < h; y++) {
+        putInt(y);
+        putInt(int32_t(lineSize - 8));
+        for (int c = 2; c >= 0; c--) {
+            for (int x = 0; x < w; x++) {
+                putFloat(image[(size_t(y) * w + x) * 4 + c]);
+            }
+        }
+    }
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+    return fclose(f) == 0 && ok;
+}
+
+// The .mca files of worldDir, sorted. If the directory cannot be read,
+// error is set and the list is empty.
+std::vector<std::string> listRegionFiles(const std::string &worldDir,
+                                         std::error_code &error) {
+    std::vector<std::string> filenames;
+    fs::directory_iterator end;
+    for (fs::directory_iterator it(worldDir, error); !error && it != end;
+         it.increment(error)) {
+        if (it->path().extension() == ".mca") {
+            filenames.emplace_back(it->path().string());
+        }
+    }
+    if (error) {
+        filenames.clear();
+    }
+    std::sort(filenames.begin(), filenames.end());
+    return filenames;
+}
+std::vector<std::string> listRegionFiles(const std::string &worldDir) {
+    std::error_code error;
+    auto filenames = listRegionFiles(worldDir, error);
+    if (error) {
+        printf("cannot read %s: %s\n", worldDir.c_str(), error.message().c_str());
+    }
+    return filenames;
+}
+
+// Read only mapping of a whole file
+struct MappedFile {
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+#endif
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    explicit MappedFile(const std::string &filename) {
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                           nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                           nullptr);
+        LARGE_INTEGER fileSize;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize) ||
+            fileSize.QuadPart == 0) {
+            return;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping) {
+            data = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            size = data ? size_t(fileSize.QuadPart) : 0;
+        }
+#else
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0) {
+            return;
+        }
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data = (const uint8_t *)p;
+                size = st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+    ~MappedFile() {
+#ifdef _WIN32
+        if (data) {
+            UnmapViewOfFile(data);
+        }
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+#else
+        if (data) {
+            munmap((void *)data, size);
+        }
+#endif
+    }
+};
+
+// Compiled world, written after a load from .mca files so that later starts
+// skip decoding and the octree build. The arrays are stored exactly as World
+// holds them: header, brick grid, brick pool, octree, each 64 byte aligned.
+// The key hashes the names, sizes and chunk timestamps of the region files;
+// bump version when the loader or any of the stored layouts change.
+struct WorldCacheHeader {
+    static constexpr uint64_t magicValue = 0x31444c524f57564eull; // "NVWORLD1"
+    static constexpr uint32_t currentVersion = 6;
+    uint64_t magic = magicValue;
+    uint32_t version = currentVersion;
+    uint32_t nodeSize = sizeof(OctreeNode);
+    uint64_t key = 0;
+    int32_t worldDimension[3] = {0, 0, 0};
+    int32_t origin[3] = {0, 0, 0};
+    int32_t octreeRoot = 0;
+    uint32_t brickWidth = BrickMap::brickWidth;
+    uint64_t gridOffset = 0, gridCount = 0;
+    uint64_t poolOffset = 0, poolSize = 0;
+    uint64_t octreeOffset = 0, octreeCount = 0;
+};
+
+inline uint64_t fnv1a(const void *data, size_t size,
+                      uint64_t hash = 14695981039346656037ull) {
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ ((const uint8_t *)data)[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+uint64_t worldCacheKey(const std::vector<std::string> &filenames,
+                       const std::optional<Box3i> &bounds) {
+    std::vector<uint64_t> keys(filenames.size());
+    parallelFor(filenames.size(), [&](size_t i) {
+        auto name = fs::path(filenames[i]).filename().string();
+        std::error_code error;
+        uint64_t size = fs::file_size(filenames[i], error);
+        uint64_t key = fnv1a(name.data(), name.size());
+        key = fnv1a(&size, sizeof(size), key);
+        // the timestamps sit in the region header, only its pages are read
+        auto region = enkiRegionFileMap(filenames[i].c_str());
+        for (int chunk = 0; chunk < ENKI_MI_REGION_CHUNKS_NUMBER; chunk++) {
+            int32_t timestamp = enkiGetTimestampForChunk(region, chunk);
+            key = fnv1a(&timestamp, sizeof(timestamp), key);
+        }
+        enkiRegionFileFreeAllocations(&region);
+        keys[i] = key;
+    });
+    uint64_t key = fnv1a(keys.data(), keys.size() * sizeof(uint64_t));
+    if (bounds) {
+        key = fnv1a(&*bounds, sizeof(Box3i), key);
+    }
+    return key;
+}
+
+std::shared_ptr<World> loadWorldCache(const std::string &filename,
+                                      uint64_t key) {
+    MappedFile file(filename);
+    if (file.size < sizeof(WorldCacheHeader)) {
+        return nullptr;
+    }
+    WorldCacheHeader header;
+    memcpy(&header, file.data, sizeof(header));
+    if (header.magic != WorldCacheHeader::magicValue ||
+        header.version != WorldCacheHeader::currentVersion ||
+        header.nodeSize != sizeof(OctreeNode) ||
+        header.brickWidth != BrickMap::brickWidth) {
+        printf("%s: not a world cache of this version\n", filename.c_str());
+        return nullptr;
+    }
+    if (header.key != key) {
+        printf("%s: region files changed\n", filename.c_str());
+        return nullptr;
+    }
+    auto inFile = [&](uint64_t offset, uint64_t size) {
+        return offset <= file.size && size <= file.size - offset;
+    };
+    ivec3 dimension(header.worldDimension[0], header.worldDimension[1],
+                    header.worldDimension[2]);
+    auto world = std::make_shared<World>(dimension);
+    auto &voxels = world->voxels;
+    if (!inFile(header.gridOffset, header.gridCount * sizeof(uint32_t)) ||
+        !inFile(header.poolOffset, header.poolSize) ||
+        !inFile(header.octreeOffset, header.octreeCount * sizeof(OctreeNode)) ||
+        header.gridCount != voxels.grid.size() ||
+        header.poolSize % BrickMap::brickVolume != 0 ||
+        header.octreeRoot < 0 || uint64_t(header.octreeRoot) >= header.octreeCount) {
+        printf("%s: corrupt world cache\n", filename.c_str());
+        return nullptr;
+    }
+    auto grid = (const uint32_t *)(file.data + header.gridOffset);
+    auto pool = file.data + header.poolOffset;
+    auto octree = (const OctreeNode *)(file.data + header.octreeOffset);
+    voxels.grid.assign(grid, grid + header.gridCount);
+    voxels.pool.assign(pool, pool + header.poolSize);
+    world->octree.assign(octree, octree + header.octreeCount);
+    world->octreeRoot = header.octreeRoot;
+    world->origin = ivec3(header.origin[0], header.origin[1], header.origin[2]);
+    size_t bricks = voxels.brickCount();
+    for (auto ref : voxels.grid) {
+        if (!(ref & BrickMap::uniformBrick) && ref >= bricks) {
+            printf("%s: corrupt world cache\n", filename.c_str());
+            return nullptr;
+        }
+    }
+    return world;
+}
+
+bool saveWorldCache(const std::string &filename, uint64_t key,
+                    const World &world) {
+    auto align = [](uint64_t offset) { return (offset + 63) & ~uint64_t(63); };
+    WorldCacheHeader header;
+    header.key = key;
+    for (int i = 0; i < 3; i++) {
+        header.worldDimension[i] = world.worldDimension[i];
+        header.origin[i] = world.origin[i];
+    }
+    header.octreeRoot = world.octreeRoot;
+    header.gridOffset = align(sizeof(header));
+    header.gridCount = world.voxels.grid.size();
+    header.poolOffset = align(header.gridOffset + header.gridCount * sizeof(uint32_t));
+    header.poolSize = world.voxels.pool.size();
+    header.octreeOffset = align(header.poolOffset + header.poolSize);
+    header.octreeCount = world.octree.size();
+
+    // written next to the target and renamed, a cache is never half written
+    auto temporary = filename + ".tmp";
+    FILE *f = fopen(temporary.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    uint64_t position = 0;
+    auto write = [&](uint64_t offset, const void *data, size_t size) {
+        static const uint8_t zeros[64] = {};
+        bool ok = fwrite(zeros, 1, offset - position, f) == offset - position &&
+                  fwrite(data, 1, size, f) == size;
+        position = offset + size;
+        return ok;
+    };
+    bool ok = write(0, &header, sizeof(header)) &&
+              write(header.gridOffset, world.voxels.grid.data(),
+                    header.gridCount * sizeof(uint32_t)) &&
+              write(header.poolOffset, world.voxels.pool.data(), header.poolSize) &&
+              write(header.octreeOffset, world.octree.data(),
+                    header.octreeCount * sizeof(OctreeNode));
+    ok = fclose(f) == 0 && ok;
+    std::error_code error;
+    if (ok) {
+        fs::rename(temporary, filename, error);
+    }
+    if (!ok || error) {
+        fs::remove(temporary, error);
+        return false;
+    }
+    return true;
+}
+
+// The cached world of the region files of worldDir within bounds, nullptr
+// if the cache is disabled (empty filename), missing or stale. key receives
+// the key a new cache is to be saved with.
+std::shared_ptr<World> findWorldCache(const std::string &worldDir,
+                                      const std::string &cacheFilename,
+                                      const std::optional<Box3i> &bounds,
+                                      uint64_t &key) {
+    using clock = std::chrono::high_resolution_clock;
+    auto t0 = clock::now();
+    key = 0;
+    if (cacheFilename.empty()) {
+        return nullptr;
+    }
+    auto filenames = listRegionFiles(worldDir);
+    if (bounds) {
+        filenames = regionFilesIn(filenames, *bounds);
+    }
+    key = worldCacheKey(filenames, bounds);
+    auto world = loadWorldCache(cacheFilename, key);
+    if (world) {
+        std::chrono::duration<double> elapsed = clock::now() - t0;
+        printf("loaded %s in %.2fs\n", cacheFilename.c_str(), elapsed.count());
+    }
+    return world;
+}
+
+// Loads the world from the cache when it matches the region files and
+// bounds, otherwise from the region files, building the octree and writing a
+// new cache. An empty cache filename disables the cache.
+std::shared_ptr<World> loadWorld(const std::string &worldDir,
+                                 const std::string &cacheFilename,
+                                 const std::optional<Box3i> &bounds) {
+    uint64_t key;
+    if (auto world = findWorldCache(worldDir, cacheFilename, bounds, key)) {
+        return world;
+    }
+    auto filenames = listRegionFiles(worldDir);
+    if (bounds) {
+        filenames = regionFilesIn(filenames, *bounds);
+    }
+    auto world = McLoader(filenames, bounds);
+    if (!world) {
+        // renderHeadless and Application use the world unchecked
+        printf("no world could be loaded from %s\n", worldDir.c_str());
+        exit(1);
+    }
+    world->buildOctree();
+    if (!cacheFilename.empty()) {
+        if (saveWorldCache(cacheFilename, key, *world)) {
+            printf("wrote %s\n", cacheFilename.c_str());
+        } else {
+            printf("failed to write %s\n", cacheFilename.c_str());
+        }
+    }
+    return world;
+}
+
+
+// Polls the region files of a world and patches the chunks whose timestamp
+// changed into it. Only the octree subtrees touching those chunks are
+// rebuilt, and only the changed bricks and nodes need uploading. The world
+// bounds stay those of the initial load.
+struct WorldWatcher {
+    struct Region {
+        std::string filename;
+        ivec2 position;
+        uintmax_t size = 0;
+        fs::file_time_type writeTime;
+        std::vector<int32_t> timestamps =
+            std::vector<int32_t>(ENKI_MI_REGION_CHUNKS_NUMBER, 0);
+    };
+    std::string worldDir;
+    std::vector<Region> regions;
+    std::chrono::steady_clock::time_point lastPoll;
+
+    explicit WorldWatcher(const std::string &worldDir) : worldDir(worldDir) {
+        // the world was just loaded from these files, only later changes
+        // are patched
+        std::vector<std::pair<size_t, int>> changed;
+        std::vector<enkiRegionFile> mapped;
+        addRegions();
+        scanRegions(changed, mapped);
+        for (auto &region : mapped) {
+            enkiRegionFileFreeAllocations(&region);
+        }
+        lastPoll = std::chrono::steady_clock::now();
+    }
+
+    // Adds the region files that appeared. Returns false if the directory
+    // cannot be read, as while a backup swaps it out.
+    bool addRegions() {
+        std::error_code error;
+        auto filenames = listRegionFiles(worldDir, error);
+        if (error) {
+            return false;
+        }
+        for (auto &filename : filenames) {
+            auto position = regionCoordinates(filename);
+            if (!position ||
+                std::any_of(regions.begin(), regions.end(),
+                            [&](const Region &r) { return r.filename == filename; })) {
+                continue;
+            }
+            Region region;
+            region.filename = filename;
+            region.position = *position;
+            regions.push_back(region);
+        }
+        return true;
+    }
+
+    // Collects the chunks (region index, chunk index) whose timestamp
+    // changed, mapping the regions they are in. A missing file has no
+    // chunks.
+    void scanRegions(std::vector<std::pair<size_t, int>> &changed,
+                     std::vector<enkiRegionFile> &mapped) {
+        mapped.resize(regions.size());
+        for (size_t i = 0; i < regions.size(); i++) {
+            auto &region = regions[i];
+            enkiRegionFileInit(&mapped[i]);
+            std::error_code error;
+            auto size = fs::file_size(region.filename, error);
+            auto writeTime = fs::last_write_time(region.filename, error);
+            if (error) {
+                size = 0;
+                writeTime = fs::file_time_type();
+            }
+            if (size == region.size && writeTime == region.writeTime) {
+                continue;
+            }
+            region.size = size;
+            region.writeTime = writeTime;
+            if (size) {
+                mapped[i] = enkiRegionFileMap(region.filename.c_str());
+            }
+            for (int chunk = 0; chunk < ENKI_MI_REGION_CHUNKS_NUMBER; chunk++) {
+                int32_t timestamp =
+                    mapped[i].pRegionData
+                        ? enkiGetTimestampForChunk(mapped[i], chunk)
+                        : 0;
+                if (timestamp != region.timestamps[chunk]) {
+                    region.timestamps[chunk] = timestamp;
+                    changed.emplace_back(i, chunk);
+                }
+            }
+        }
+    }
+
+    // Patches the changed chunks into world, at most once a second. Returns
+    // true if the world changed and its edits need uploading.
+    bool poll(World &world) {
+        using clock = std::chrono::steady_clock;
+        auto t0 = clock::now();
+        if (t0 - lastPoll < std::chrono::seconds(1)) {
+            return false;
+        }
+        lastPoll = t0;
+        // the files of an unreadable directory would all look deleted
+        if (!addRegions()) {
+            return false;
+        }
+        std::vector<std::pair<size_t, int>> changed;
+        std::vector<enkiRegionFile> mapped;
+        scanRegions(changed, mapped);
+        std::vector<std::optional<DecodedChunk>> chunks(changed.size());
+        InflateStats stats;
+        parallelFor(changed.size(), [&](size_t i) {
+            auto &region = mapped[changed[i].first];
+            if (region.pRegionData) {
+                chunks[i] = decodeChunk(region, changed[i].second, stats);
+            }
+        });
+        for (auto &region : mapped) {
+            enkiRegionFileFreeAllocations(&region);
+        }
+        if (changed.empty()) {
+            return false;
+        }
+        std::vector<Box3i> edits;
+        size_t clipped = 0;
+        for (size_t i = 0; i < changed.size(); i++) {
+            int index = changed[i].second;
+            // chunks are indexed x + 32 z in a region
+            ivec2 position = regions[changed[i].first].position * 32 +
+                             ivec2(index % 32, index / 32);
+            const auto &chunk = chunks[i];
+            if (auto box = world.replaceChunk(
+                    position, chunk && !chunk->empty() ? &*chunk : nullptr)) {
+                edits.push_back(*box);
+            }
+            // voxels outside the initial bounds are dropped
+            if (chunk && !chunk->empty() &&
+                (any(lessThan(chunk->pmin, world.origin)) ||
+                 any(greaterThanEqual(chunk->pmax,
+                                      world.origin + world.worldDimension)))) {
+                clipped++;
+            }
+        }
+        if (clipped) {
+            printf("%zu chunks clipped to the world bounds\n", clipped);
+        }
+        if (edits.empty()) {
+            return false;
+        }
+        world.updateOctree(edits);
+        std::chrono::duration<double> elapsed = clock::now() - t0;
+        printf("patched %zu chunks in %.3fs\n", changed.size(), elapsed.count());
+        return true;
+    }
+};
+
+// Streams the regions of a world too large for memory. The world covers the
+// bounds of every region file but only the regions nearest to the camera,
+// favouring those in front of it, are loaded, as many as fit in the memory
+// budget. They are decoded on a background thread and patched in like
+// hot reloaded chunks. Regions that no longer fit are evicted farthest
+// first, their bricks being reused by the next loads. The budget also pays
+// for the per brick cell arrays of the whole world, which do not shrink
+// with what is loaded; a world whose arrays alone exceed it is rejected.
+struct WorldStreamer {
+    static const int regionWidth = 32 * ENKI_MI_SIZE_SECTIONS;
+    struct Region {
+        std::string filename;
+        ivec2 position;
+        bool loaded = false;
+        bool requested = false; // queued or being decoded
+        size_t bytes = 0;       // brick storage used once loaded
+        uint64_t lastWanted = 0;
+        bool evicted = false; // since the camera last moved
+    };
+    struct DecodedRegion {
+        size_t region;
+        std::vector<std::optional<DecodedChunk>> chunks;
+    };
+    std::shared_ptr<World> world;
+    std::vector<Region> regions;
+    size_t budget; // bytes of brick storage and brick cell arrays
+    size_t cellBytes = 0; // of the brick cell arrays, see brickCellBytes
+    uint64_t tick = 0;
+    vec3 lastCameraPosition = vec3(0), lastCameraForward = vec3(0);
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<size_t> queue; // most wanted last
+    std::vector<DecodedRegion> decoded;
+    bool decoding = false;
+    bool quit = false;
+
+    // The world is sized to the chunks present in the region headers, read
+    // without inflating any chunk. Regions without chunks are left out.
+    WorldStreamer(const std::string &worldDir, size_t budget) : budget(budget) {
+        for (auto &filename : listRegionFiles(worldDir)) {
+            if (auto position = regionCoordinates(filename)) {
+                Region region;
+                region.filename = filename;
+                region.position = *position;
+                regions.push_back(region);
+            }
+        }
+        std::vector<ivec2> chunkMin(regions.size(),
+                                    ivec2(std::numeric_limits<int>::max()));
+        std::vector<ivec2> chunkMax(regions.size(),
+                                    ivec2(std::numeric_limits<int>::min()));
+        parallelFor(regions.size(), [&](size_t i) {
+            auto regionFile = enkiRegionFileMap(regions[i].filename.c_str());
+            if (!regionFile.pRegionData) {
+                return;
+            }
+            for (int chunk = 0; chunk < ENKI_MI_REGION_CHUNKS_NUMBER; chunk++) {
+                if (enkiHasChunk(regionFile, chunk)) {
+                    ivec2 position = regions[i].position * 32 +
+                                     ivec2(chunk % 32, chunk / 32);
+                    chunkMin[i] = min(chunkMin[i], position);
+                    chunkMax[i] = max(chunkMax[i], position);
+                }
+            }
+            enkiRegionFileFreeAllocations(&regionFile);
+        });
+        ivec2 worldMin(std::numeric_limits<int>::max());
+        ivec2 worldMax(std::numeric_limits<int>::min());
+        std::vector<Region> present;
+        for (size_t i = 0; i < regions.size(); i++) {
+            if (chunkMin[i].x <= chunkMax[i].x) {
+                worldMin = min(worldMin, chunkMin[i]);
+                worldMax = max(worldMax, chunkMax[i]);
+                present.push_back(regions[i]);
+            }
+        }
+        regions = std::move(present);
+        if (regions.empty()) {
+            printf("no chunks in %s\n", worldDir.c_str());
+            exit(1);
+        }
+        ivec2 size = (worldMax - worldMin + ivec2(1)) * ENKI_MI_SIZE_SECTIONS;
+        ivec3 dimension(size.x,
+                        ENKI_MI_NUM_SECTIONS_PER_CHUNK * ENKI_MI_SIZE_SECTIONS,
+                        size.y);
+        cellBytes = brickCellBytes(dimension);
+        if (cellBytes >= budget) {
+            fprintf(stderr,
+                    "streaming %zu regions needs %.1f MB for the brick cells of "
+                    "a %d x %d x %d world alone, over the budget of %.1f MB; "
+                    "raise --budget or stream fewer regions\n",
+                    regions.size(), cellBytes / (1024.0 * 1024.0), dimension.x,
+                    dimension.y, dimension.z, budget / (1024.0 * 1024.0));
+            exit(1);
+        }
+        world = std::make_shared<World>(dimension);
+        world->origin = ivec3(worldMin.x, ENKI_MI_MIN_SECTION_Y, worldMin.y) *
+                        ENKI_MI_SIZE_SECTIONS;
+        printf("streaming %zu regions, world size %d %d %d\n", regions.size(),
+               world->worldDimension.x, world->worldDimension.y,
+               world->worldDimension.z);
+        world->buildOctree();
+        worker = std::thread([this]() { decodeRegions(); });
+    }
+    ~WorldStreamer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
 
-        glGenTextures(1, &accum);
-        glBindTexture(GL_TEXTURE_2D, accum);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 1280, 720, 0, GL_RGBA,
-                     GL_FLOAT, NULL);
+    void decodeRegions() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&]() { return quit || !queue.empty(); });
+            if (quit) {
+                return;
+            }
+            DecodedRegion result;
+            result.region = queue.back();
+            queue.pop_back();
+            decoding = true;
+            auto filename = regions[result.region].filename;
+            lock.unlock();
+            auto regionFile = enkiRegionFileMap(filename.c_str());
+            result.chunks.resize(ENKI_MI_REGION_CHUNKS_NUMBER);
+            if (regionFile.pRegionData) {
+                InflateStats stats;
+                parallelFor(result.chunks.size(), [&](size_t i) {
+                    result.chunks[i] = decodeChunk(regionFile, int(i), stats);
+                });
+            } else {
+                printf("failed to map file %s\n", filename.c_str());
+            }
+            enkiRegionFileFreeAllocations(&regionFile);
+            lock.lock();
+            decoded.push_back(std::move(result));
+            decoding = false;
+        }
+    }
 
-        glGenTextures(1, &composed);
-        glBindTexture(GL_TEXTURE_2D, composed);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 1280, 720, 0, GL_RGBA,
-                     GL_FLOAT, NULL);
-
-        std::vector<float> seeds;
-        for (size_t i = 0; i < 1920 * 1080; i++) {
-            seeds.emplace_back(uintBitsToFloat(rand()));
-            seeds.emplace_back(uintBitsToFloat(rand()));
-            seeds.emplace_back(uintBitsToFloat(rand()));
-            seeds.emplace_back(uintBitsToFloat(rand()));
-        }
-        glGenTextures(1, &seed);
-        glBindTexture(GL_TEXTURE_2D, seed);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 1920, 1080, 0, GL_RGBA,
-                     GL_FLOAT, seeds.data());
+    // Bytes of the arrays with an entry per brick cell of a world, sized by
+    // its bounds whatever is loaded: the grid and the empty distances, in
+    // memory and on the GPU, and the occupied brick sums.
+    static size_t brickCellBytes(const ivec3 &dimension) {
+        ivec3 cells = (dimension + ivec3(BrickMap::brickWidth - 1)) /
+                      BrickMap::brickWidth;
+        size_t count = size_t(cells.x) * cells.y * cells.z;
+        size_t sums = size_t(cells.x + 1) * (cells.y + 1) * (cells.z + 1);
+        return 2 * count * (sizeof(uint32_t) + sizeof(uint8_t)) +
+               sums * sizeof(uint32_t);
     }
 
-    void setUpWorld() {
-        world->buildOctree();
-        world->setUpTexture();
+    size_t usedBytes() const {
+        return cellBytes +
+               (world->voxels.brickCount() - world->voxels.freeBricks.size()) *
+                   BrickMap::brickVolume;
+    }
 
-        cameraOrigin = translate(vec3(20, 20, -20));
-        cameraDirection = identity<mat4>(); //<=inverse(M);
+    // Replaces the chunks of a region, with air if chunks is null
+    void replaceRegion(const Region &region,
+                       const std::vector<std::optional<DecodedChunk>> *chunks,
+                       std::vector<Box3i> &edits) {
+        for (int i = 0; i < ENKI_MI_REGION_CHUNKS_NUMBER; i++) {
+            const DecodedChunk *chunk = nullptr;
+            if (chunks && (*chunks)[i] && !(*chunks)[i]->empty()) {
+                chunk = &*(*chunks)[i];
+            }
+            // an absent chunk is air already when loading
+            if (!chunk && chunks) {
+                continue;
+            }
+            auto position = region.position * 32 + ivec2(i % 32, i / 32);
+            if (auto box = world->replaceChunk(position, chunk)) {
+                edits.push_back(*box);
+            }
+        }
     }
 
-    void render(GLFWwindow *window) {
-        {
-            if (needRedraw) {
-                iTime = 0;
+    // Patches in the decoded regions, fits the regions wanted from the camera
+    // to the budget, evicts what no longer fits and requests the rest.
+    // Returns true if the world changed and its edits need uploading.
+    bool update(const vec3 &cameraPosition, const vec3 &cameraForward) {
+        tick++;
+        // a region evicted to fit is not requested again before the camera
+        // moves, or a region larger than estimated could load and be
+        // evicted forever
+        if (cameraPosition != lastCameraPosition ||
+            cameraForward != lastCameraForward) {
+            lastCameraPosition = cameraPosition;
+            lastCameraForward = cameraForward;
+            for (auto &region : regions) {
+                region.evicted = false;
             }
-            double xpos, ypos;
-            auto &io = ImGui::GetIO();
-            xpos = io.MousePos.x;
-            ypos = io.MousePos.y;
+        }
 
-            auto windowPos = ImGui::GetWindowPos();
-            auto size = ImGui::GetWindowSize();
+        std::vector<DecodedRegion> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready = std::move(decoded);
+            decoded.clear();
+        }
+        std::vector<Box3i> edits;
+        for (auto &result : ready) {
+            auto &region = regions[result.region];
+            region.requested = false;
+            size_t before = usedBytes();
+            replaceRegion(region, &result.chunks, edits);
+            region.loaded = true;
+            region.bytes = usedBytes() - before;
+        }
 
-            auto pos = io.MousePos;
-            bool pressed = io.MouseDown[1];
-            bool inside =
-                (pos.x >= windowPos.x && pos.y >= windowPos.y &&
-                 pos.x < windowPos.x + size.x && pos.y < windowPos.y + size.y);
-            if (io.MouseWheel != 0 && inside && cameraMode == Orbit) {
-                iTime = 0;
-                if (io.MouseWheel < 0) {
-                    orbitDistance *= 1.1;
-                } else {
-                    orbitDistance *= 0.9;
-                }
+        // distance in regions, regions behind the camera count up to twice
+        // as far
+        vec2 eye(cameraPosition.x, cameraPosition.z);
+        vec2 forward(cameraForward.x, cameraForward.z);
+        forward = length(forward) > 0 ? normalize(forward) : forward;
+        std::vector<std::pair<float, size_t>> order(regions.size());
+        for (size_t i = 0; i < regions.size(); i++) {
+            vec2 center = vec2(regions[i].position * regionWidth -
+                               ivec2(world->origin.x, world->origin.z)) +
+                          vec2(regionWidth * 0.5f);
+            vec2 offset = (center - eye) / float(regionWidth);
+            float distance = length(offset);
+            float facing = distance > 0 ? dot(offset / distance, forward) : 1.0f;
+            order[i] = {distance * (1.5f - 0.5f * facing), i};
+        }
+        std::sort(order.begin(), order.end());
+
+        size_t loadedBytes = 0, loadedCount = 0;
+        for (auto &region : regions) {
+            if (region.loaded) {
+                loadedBytes += region.bytes;
+                loadedCount++;
             }
-            if (pressed && inside) {
-                if (!prevMouseDown) {
-                    mousePos = ivec2(xpos, ypos);
-                    if (mousePos != prevMousePos) {
-                        iTime = 0;
-                    }
-                }
-                auto p = ivec2(xpos, ypos);
-                if (lastFrameMousePos != p) {
-                    iTime = 0;
-                    auto rot = (vec2(p) - vec2(lastFrameMousePos)) / 300.0f *
-                               float(M_PI);
-                    eulerAngle += rot;
-                }
+        }
+        // Loaded regions count at their actual size, the others at the
+        // average loaded size. Regions are wanted by priority until the next
+        // one overflows the budget, which drops the lowest priority loaded
+        // regions once a load turned out larger than estimated.
+        size_t estimate = loadedCount ? loadedBytes / loadedCount : 0;
+        std::vector<size_t> wanted;
+        size_t wantedBytes = cellBytes;
+        bool first = true;
+        for (auto &entry : order) {
+            size_t i = entry.second;
+            if (regions[i].evicted) {
+                continue;
+            }
+            size_t bytes = regions[i].loaded ? regions[i].bytes : estimate;
+            // the nearest region is always wanted
+            if (!first && wantedBytes + bytes > budget) {
+                break;
+            }
+            first = false;
+            wantedBytes += bytes;
+            regions[i].lastWanted = tick;
+            if (!regions[i].loaded) {
+                wanted.push_back(i);
+            }
+        }
 
-            } else {
-                if (prevMouseDown) {
-                    prevMousePos = lastFrameMousePos;
+        // lowest priority first
+        size_t evicted = 0;
+        for (size_t k = order.size(); k-- > 0 && usedBytes() > budget;) {
+            auto &region = regions[order[k].second];
+            if (region.loaded && region.lastWanted < tick) {
+                replaceRegion(region, nullptr, edits);
+                region.loaded = false;
+                region.evicted = true;
+                evicted++;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto i : queue) {
+                regions[i].requested = false;
+            }
+            queue.clear();
+            // nothing is known of the region sizes before the first load
+            size_t limit = loadedCount ? wanted.size() : std::min<size_t>(1, wanted.size());
+            for (size_t j = limit; j-- > 0;) {
+                if (!regions[wanted[j]].requested) {
+                    regions[wanted[j]].requested = true;
+                    queue.push_back(wanted[j]);
                 }
             }
-            auto M = rotate(eulerAngle.x, vec3(0, 1, 0));
-            M *= rotate(eulerAngle.y, vec3(1, 0, 0));
+        }
+        wake.notify_one();
 
-            std::chrono::duration<double> elapsed =
-                std::chrono::high_resolution_clock::now() - lastRenderTime;
+        if (edits.empty()) {
+            return false;
+        }
+        world->updateOctree(edits);
+        printf("streamed %zu regions in, %zu out, %.1f MB of bricks and cells\n",
+               ready.size(), evicted, usedBytes() / (1024.0 * 1024.0));
+        return true;
+    }
 
-            if (cameraMode == Orbit) {
-                auto tr = vec3(world->worldDimension) * 0.5f;
-                tr.z *= -1.0f;
-                cameraDirection = M;
-                cameraOrigin = translate(vec3(tr.x, tr.y, -tr.z)) *
-                               cameraDirection *
-                               translate(vec3(0, 0, orbitDistance * tr.z));
-            } else if (elapsed.count() > 1.0 / 30.0) {
-                lastRenderTime = std::chrono::high_resolution_clock::now();
-                // free
-                float vel = 6.0f;
-                float step = vel / 30.0;
-                vec3 o = cameraOrigin * vec4(0, 0, 0, 1);
-                auto R = rotate(eulerAngle.x, vec3(0, 1, 0));
-                if (io.KeyShift) {
-                    step *= 10.0f;
-                }
-                if (io.KeysDown['A']) {
-                    o += vec3(step * R * vec4(-1, 0, 0, 1));
-                    iTime = 0;
-                }
-                if (io.KeysDown['D']) {
-                    o += vec3(step * R * vec4(1, 0, 0, 1));
-                    iTime = 0;
-                }
-                if (io.KeysDown['W']) {
-                    o += vec3(step * R * vec4(0, 0, 1, 1));
-                    iTime = 0;
-                }
-                if (io.KeysDown['S']) {
-                    o += vec3(step * R * vec4(0, 0, -1, 1));
-                    iTime = 0;
-                }
-                if (io.KeyCtrl) {
-                    o += vec3(step * R * vec4(0, -1, 0, 1));
-                    iTime = 0;
-                }
-                if (io.KeysDown[' ']) {
-                    o += vec3(step * R * vec4(0, 1, 0, 1));
-                    iTime = 0;
+    // True while wanted regions are still queued or being decoded
+    bool busy() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return decoding || !queue.empty() || !decoded.empty();
+    }
+
+    size_t loadedRegions() const {
+        return std::count_if(regions.begin(), regions.end(),
+                             [](const Region &region) { return region.loaded; });
+    }
+};
+
+struct CommandLine {
+    bool headless = false;
+    bool cpu = false;
+    std::string worldDir = "../data";
+    std::string cache; // defaults to world.nvcache in worldDir
+    bool useCache = true;
+    bool watch = false;
+    bool stream = false;
+    bool dag = false; // trace a sparse voxel DAG, see VoxelDag
+    bool tree64 = false; // trace a Tree64 instead of the octree
+    // blocks to load, pmax exclusive; unbounded axes span +-2^28
+    std::optional<Box3i> bounds;
+    size_t budget = size_t(1024) << 20; // bytes of the world when streaming
+    std::string output = "render.png";
+    ivec2 resolution = ivec2(1280, 720);
+    int spp = 64;
+    int maxDepth = 2;
+    // orbit: yaw, pitch (degrees), distance; free: x, y, z, yaw, pitch
+    bool freeCamera = false;
+    vec3 cameraOrigin = vec3(0);
+    vec2 cameraAngles = vec2(0);
+    float orbitDistance = 2.5f;
+    std::optional<vec2> sun; // height, direction in degrees
+
+    static void usage() {
+        fprintf(stderr,
+                "usage: NanoVoxel [--world dir] [--cache file | --no-cache] [--watch] [--dag]\n"
+                "                 [--tree64] [--stream [--budget MB]] [--aabb x0,z0,x1,z1]\n"
+                "                 [--y-range y0,y1]\n"
+                "       NanoVoxel --headless [--cpu] [--dag] [--tree64] [--world dir]\n"
+                "                 [--output file.png|exr]\n"
+                "                 [--stream [--budget MB]] [--aabb x0,z0,x1,z1] [--y-range y0,y1]\n"
+                "                 [--resolution WxH] [--spp n] [--max-depth n]\n"
+                "                 [--orbit yaw,pitch,distance | --camera x,y,z,yaw,pitch]\n"
+                "                 [--sun height,direction]\n");
+        exit(1);
+    }
+    static Box3i unbounded() {
+        return Box3i{ivec3(-(1 << 28)), ivec3(1 << 28)};
+    }
+    static std::vector<float> parseFloats(const char *s, size_t count,
+                                          char sep = ',') {
+        std::vector<float> v;
+        std::istringstream in(s);
+        std::string item;
+        while (std::getline(in, item, sep)) {
+            char *end = nullptr;
+            v.push_back(strtof(item.c_str(), &end));
+            if (item.empty() || *end) {
+                usage();
+            }
+        }
+        if (v.size() != count) {
+            usage();
+        }
+        return v;
+    }
+    static CommandLine parse(int argc, char **argv) {
+        CommandLine cl;
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            auto value = [&]() {
+                if (i + 1 >= argc) {
+                    usage();
                 }
-                cameraOrigin = translate(o);
-                cameraDirection = M;
+                return argv[++i];
+            };
+            if (arg == "--headless") {
+                cl.headless = true;
+            } else if (arg == "--cpu") {
+                cl.cpu = true;
+            } else if (arg == "--world") {
+                cl.worldDir = value();
+            } else if (arg == "--cache") {
+                cl.cache = value();
+            } else if (arg == "--no-cache") {
+                cl.useCache = false;
+            } else if (arg == "--watch") {
+                cl.watch = true;
+            } else if (arg == "--stream") {
+                cl.stream = true;
+            } else if (arg == "--dag") {
+                cl.dag = true;
+            } else if (arg == "--tree64") {
+                cl.tree64 = true;
+            } else if (arg == "--aabb") {
+                auto v = parseFloats(value(), 4);
+                cl.bounds = cl.bounds.value_or(unbounded());
+                cl.bounds->pmin.x = int(std::min(v[0], v[2]));
+                cl.bounds->pmin.z = int(std::min(v[1], v[3]));
+                cl.bounds->pmax.x = int(std::max(v[0], v[2])) + 1;
+                cl.bounds->pmax.z = int(std::max(v[1], v[3])) + 1;
+            } else if (arg == "--y-range") {
+                auto v = parseFloats(value(), 2);
+                cl.bounds = cl.bounds.value_or(unbounded());
+                cl.bounds->pmin.y = int(std::min(v[0], v[1]));
+                cl.bounds->pmax.y = int(std::max(v[0], v[1])) + 1;
+            } else if (arg == "--budget") {
+                cl.budget = size_t(parseFloats(value(), 1)[0] * (1 << 20));
+            } else if (arg == "--output") {
+                cl.output = value();
+            } else if (arg == "--resolution") {
+                auto v = parseFloats(value(), 2, 'x');
+                cl.resolution = ivec2(v[0], v[1]);
+            } else if (arg == "--spp") {
+                cl.spp = (int)parseFloats(value(), 1)[0];
+            } else if (arg == "--max-depth") {
+                cl.maxDepth = (int)parseFloats(value(), 1)[0];
+            } else if (arg == "--orbit") {
+                auto v = parseFloats(value(), 3);
+                cl.freeCamera = false;
+                cl.cameraAngles = vec2(v[0], v[1]);
+                cl.orbitDistance = v[2];
+            } else if (arg == "--camera") {
+                auto v = parseFloats(value(), 5);
+                cl.freeCamera = true;
+                cl.cameraOrigin = vec3(v[0], v[1], v[2]);
+                cl.cameraAngles = vec2(v[3], v[4]);
+            } else if (arg == "--sun") {
+                auto v = parseFloats(value(), 2);
+                cl.sun = vec2(v[0], v[1]);
+            } else {
+                usage();
             }
-            prevMouseDown = pressed;
-            lastFrameMousePos = ivec2(xpos, ypos);
         }
-        float theta = (world->sunHeight - M_PI_2);
-        float phi = world->sunPhi;
-        vec3 sunPos = normalize(
-            vec3(cos(phi) * sin(theta), cos(theta), sin(phi) * sin(theta)));
-        int w = 1280, h = 720;
-        glUseProgram(program);
-        glActiveTexture(GL_TEXTURE0 + 0);
-        glBindTexture(GL_TEXTURE_3D, world->world);
-        glBindTexture(GL_TEXTURE_2D, accum);
-        glBindImageTexture(1, accum, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
-        glBindTexture(GL_TEXTURE_2D, seed);
-        glBindImageTexture(2, seed, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
-        glBindTexture(GL_TEXTURE_2D, composed);
-        glBindImageTexture(3, composed, 0, GL_FALSE, 0, GL_WRITE_ONLY,
-                           GL_RGBA32F);
-        glUniform1i(glGetUniformLocation(program, "octreeRoot"),
-                    world->octreeRoot);
-        glUniform1i(glGetUniformLocation(program, "world"), 0);
-        glUniform1f(glGetUniformLocation(program, "maxRayIntensity"),
-                    maxRayIntensity);
-        glUniform2f(glGetUniformLocation(program, "iResolution"), w, h);
-        glUniform3i(glGetUniformLocation(program, "worldDimension"),
-                    world->worldDimension.x, world->worldDimension.y,
-                    world->worldDimension.z);
-        glUniform1i(glGetUniformLocation(program, "iTime"), iTime++);
-        glUniform1ui(glGetUniformLocation(program, "options"), options);
-        glUniform1i(glGetUniformLocation(program, "maxDepth"), maxDepth);
-        glUniformMatrix4fv(glGetUniformLocation(program, "cameraOrigin"), 1,
-                           GL_FALSE, &cameraOrigin[0][0]);
-        glUniformMatrix4fv(glGetUniformLocation(program, "cameraDirection"), 1,
-                           GL_FALSE, &cameraDirection[0][0]);
-        glUniform3fv(glGetUniformLocation(program, "sunPos"), 1,
-                     (float *)&sunPos);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, world->materialsSSBO);
-        if (needRedraw) {
-            // printf("redraw\n");
+        if (cl.resolution.x <= 0 || cl.resolution.y <= 0 || cl.spp <= 0 ||
+            (cl.stream && (cl.watch || cl.bounds))) {
+            usage();
+        }
+        if (cl.cpu && (cl.dag || cl.tree64)) {
+            fprintf(stderr, "--cpu only traces the octree, not --dag or --tree64\n");
+            usage();
+        }
+        std::error_code error;
+        if (!fs::is_directory(cl.worldDir, error)) {
+            fprintf(stderr, "no world directory %s\n", cl.worldDir.c_str());
+            usage();
+        }
+        if (!cl.useCache) {
+            cl.cache.clear();
+        } else if (cl.cache.empty()) {
+            cl.cache = (fs::path(cl.worldDir) / "world.nvcache").string();
+        }
+        return cl;
+    }
+};
 
-            GLvoid *p = glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_WRITE_ONLY);
-            memcpy(p, world->materials.get(), sizeof(World::Materials));
-            glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+// Creates a GL 4.3 context without a window: a surfaceless EGL context where
+// available (works on Mesa llvmpipe without a display), else a hidden window
+bool createHeadlessContext() {
+#ifdef NANOVOXEL_HAS_EGL
+    auto getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+            "eglGetPlatformDisplayEXT");
+    EGLDisplay display =
+        getPlatformDisplay
+            ? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                                 EGL_DEFAULT_DISPLAY, nullptr)
+            : eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    EGLint major, minor;
+    if (display != EGL_NO_DISPLAY && eglInitialize(display, &major, &minor) &&
+        eglBindAPI(EGL_OPENGL_API)) {
+        const EGLint attributes[] = {EGL_CONTEXT_MAJOR_VERSION,
+                                     4,
+                                     EGL_CONTEXT_MINOR_VERSION,
+                                     3,
+                                     EGL_CONTEXT_OPENGL_PROFILE_MASK,
+                                     EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                                     EGL_NONE};
+        EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR,
+                                              EGL_NO_CONTEXT, attributes);
+        if (context != EGL_NO_CONTEXT &&
+            eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+            printf("using surfaceless EGL %d.%d context\n", major, minor);
+            return gl3wInit() == 0;
         }
+    }
+    fprintf(stderr, "no surfaceless EGL context, trying a hidden window\n");
+#endif
+    if (!glfwInit()) {
+        return false;
+    }
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow *window =
+        glfwCreateWindow(64, 64, "NanoVoxel", nullptr, nullptr);
+    if (!window) {
+        return false;
+    }
+    glfwMakeContextCurrent(window);
+    return gl3wInit() == 0;
+}
 
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, world->materialsSSBO);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, world->octreeBuffer);
-        glDispatchCompute(std::ceil(w / 16), std::ceil(h / 16), 1);
-        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-        glFinish();
-        if (iTime % 200 == 0)
-            printf("pass = %d\n", iTime);
-        needRedraw = false;
+// Renders on the GPU, or with CpuRenderer and no GL context at all when
+// --cpu is given
+int renderHeadless(const CommandLine &cl) {
+    if (!cl.cpu && !createHeadlessContext()) {
+        fprintf(stderr, "failed to create an OpenGL context\n");
+        return 1;
     }
-};
+    if (!cl.cpu) {
+        glEnable(GL_DEBUG_OUTPUT);
+        glDebugMessageCallback(MessageCallback, 0);
+    }
+
+    Renderer renderer;
+    renderer.resolution = cl.resolution;
+    renderer.maxDepth = cl.maxDepth;
+    renderer.useDag = cl.dag;
+    if (cl.tree64) {
+        renderer.options |= USE_TREE64;
+    }
+    if (!cl.cpu) {
+        renderer.compileShader();
+    }
+    std::unique_ptr<WorldStreamer> streamer;
+    if (cl.stream) {
+        streamer = std::make_unique<WorldStreamer>(cl.worldDir, cl.budget);
+        renderer.world = streamer->world;
+    } else {
+        renderer.world = loadWorld(cl.worldDir, cl.cache, cl.bounds);
+    }
+    renderer.world->loadMinecraftMaterials();
+    if (cl.sun) {
+        renderer.world->sunHeight = cl.sun->x / 180.0f * M_PI;
+        renderer.world->sunPhi = cl.sun->y / 180.0f * M_PI;
+    }
+    renderer.eulerAngle = cl.cameraAngles / 180.0f * float(M_PI);
+    if (cl.freeCamera) {
+        renderer.setFreeCamera(cl.cameraOrigin);
+    } else {
+        renderer.cameraMode = Renderer::Orbit;
+        renderer.orbitDistance = cl.orbitDistance;
+        renderer.updateOrbitCamera();
+    }
+    // the image is of the regions streamed in for the camera
+    while (streamer && (streamer->update(renderer.cameraPosition(),
+                                         renderer.cameraForward()) ||
+                        streamer->busy())) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (!cl.cpu) {
+        renderer.setUpWorld();
+    }
+
+    std::unique_ptr<CpuRenderer> cpuRenderer;
+    if (cl.cpu) {
+        cpuRenderer = std::make_unique<CpuRenderer>(renderer);
+    }
+    using clock = std::chrono::high_resolution_clock;
+    auto t0 = clock::now();
+    for (int i = 0; i < cl.spp; i++) {
+        if (cpuRenderer) {
+            cpuRenderer->renderPass();
+        } else {
+            renderer.renderPass();
+        }
+    }
+    std::chrono::duration<double> elapsed = clock::now() - t0;
+    double samples = double(cl.spp) * cl.resolution.x * cl.resolution.y;
+    printf("rendered %dx%d at %d spp in %.2fs, %.2f Msamples/s\n",
+           cl.resolution.x, cl.resolution.y, cl.spp, elapsed.count(),
+           samples / elapsed.count() * 1e-6);
+
+    auto image = cpuRenderer ? cpuRenderer->readAccumulated()
+                             : renderer.readAccumulated();
+    auto extension = fs::path(cl.output).extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   ::tolower);
+    bool ok = extension == ".exr"
+                  ? writeEXR(cl.output, cl.resolution.x, cl.resolution.y, image)
+                  : writePNG(cl.output, cl.resolution.x, cl.resolution.y, image);
+    if (!ok) {
+        fprintf(stderr, "failed to write %s\n", cl.output.c_str());
+        return 1;
+    }
+    printf("wrote %s\n", cl.output.c_str());
+    return 0;
+}
 
 struct Application {
     GLFWwindow *window;
     std::unique_ptr<Renderer> renderer;
+    std::unique_ptr<WorldWatcher> watcher;
+    std::unique_ptr<WorldStreamer> streamer;
+    // regions still loading in the background, the world is cached once
+    // they are all in
+    bool progressive = false;
+    std::string cacheFilename;
+    uint64_t cacheKey = 0;
 
-    Application() {
+    explicit Application(const CommandLine &cl) : cacheFilename(cl.cache) {
         if (!glfwInit()) {
             fprintf(stderr, "failed to init glfw");
             exit(1);
@@ -802,14 +4307,33 @@ struct Application {
         ImGui_ImplOpenGL3_Init("#version 430");
 
         renderer = std::make_unique<Renderer>();
-        std::vector<std::string> filenames;
-        for (auto &p : fs::directory_iterator("../data")) {
-            filenames.emplace_back(p.path().string());
+        renderer->useDag = cl.dag;
+        if (cl.tree64) {
+            renderer->options |= USE_TREE64;
         }
         renderer->compileShader();
-        renderer->world = McLoader(filenames);
+        if (cl.stream) {
+            streamer = std::make_unique<WorldStreamer>(cl.worldDir, cl.budget);
+            renderer->world = streamer->world;
+        } else if (cl.bounds) {
+            renderer->world = loadWorld(cl.worldDir, cl.cache, cl.bounds);
+        } else {
+            renderer->world =
+                findWorldCache(cl.worldDir, cl.cache, std::nullopt, cacheKey);
+        }
+        if (!renderer->world) {
+            // the first frame is drawn right away, regions are traced as
+            // they arrive, nearest to the camera first
+            streamer = std::make_unique<WorldStreamer>(
+                cl.worldDir, std::numeric_limits<size_t>::max());
+            renderer->world = streamer->world;
+            progressive = true;
+        }
         renderer->world->loadMinecraftMaterials();
         renderer->setUpWorld();
+        if (cl.watch) {
+            watcher = std::make_unique<WorldWatcher>(cl.worldDir);
+        }
     }
 
     int selectedMaterialIndex = 0;
@@ -885,6 +4409,13 @@ struct Application {
                         }
                         needRedraw = true;
                     }
+                    int accelerator = (renderer->options & USE_TREE64) ? 1 : 0;
+                    if (ImGui::Combo("Accelerator", &accelerator,
+                                     "Octree\0" "64-tree\0")) {
+                        renderer->options &= ~USE_TREE64;
+                        renderer->options |= accelerator ? USE_TREE64 : 0;
+                        needRedraw = true;
+                    }
                     float theta = renderer->world->sunHeight / M_PI * 180.0;
                     if (ImGui::SliderFloat("Sun Height", &theta, 0.0f,
                                            180.0f)) {
@@ -913,10 +4444,20 @@ struct Application {
                              ImGuiWindowFlags_NoScrollbar)) {
             renderer->render(window);
             ImGui::Image(reinterpret_cast<void *>(renderer->composed),
-                         ImVec2(1280, 720));
+                         ImVec2(renderer->resolution.x,
+                                renderer->resolution.y));
             ImGui::End();
         }
         showEditor();
+        if (progressive && ImGui::Begin("Loading")) {
+            size_t loaded = streamer->loadedRegions();
+            char label[64];
+            snprintf(label, sizeof(label), "%zu / %zu regions", loaded,
+                     streamer->regions.size());
+            ImGui::ProgressBar(float(loaded) / streamer->regions.size(),
+                               ImVec2(-1, 0), label);
+            ImGui::End();
+        }
     }
 
     void show() {
@@ -928,6 +4469,36 @@ struct Application {
             glClearColor(0, 0, 0, 0);
             glClear(GL_COLOR_BUFFER_BIT);
 
+            if (watcher && watcher->poll(*renderer->world)) {
+                renderer->world->uploadEdits();
+                renderer->needRedraw = true;
+            }
+            if (streamer && streamer->update(renderer->cameraPosition(),
+                                             renderer->cameraForward())) {
+                renderer->world->uploadEdits();
+                renderer->needRedraw = true;
+            }
+            if (progressive &&
+                streamer->loadedRegions() == streamer->regions.size() &&
+                !streamer->busy()) {
+                // the streamed world spans whole regions and all section
+                // heights, the cache gets it cropped the way loadWorld
+                // would have loaded it
+                auto world = cacheFilename.empty()
+                                 ? nullptr
+                                 : renderer->world->cropped();
+                if (world) {
+                    world->buildOctree();
+                    if (saveWorldCache(cacheFilename, cacheKey, *world)) {
+                        printf("wrote %s\n", cacheFilename.c_str());
+                    } else {
+                        printf("failed to write %s\n", cacheFilename.c_str());
+                    }
+                }
+                streamer.reset();
+                progressive = false;
+            }
+
             ImGui_ImplOpenGL3_NewFrame();
             ImGui_ImplGlfw_NewFrame();
             ImGui::NewFrame();
@@ -953,7 +4524,11 @@ struct Application {
 };
 
 int main(int argc, char **argv) {
-    Application app;
+    auto cl = CommandLine::parse(argc, argv);
+    if (cl.headless) {
+        return renderHeadless(cl);
+    }
+    Application app(cl);
     app.show();
 
     return 0;
@@ -1012,10 +4587,6 @@ void setUpDockSpace() {
     ImGui::End();
 }
 
-// clang-format off
-extern BlockDefinition gBlockDefinitions[];
-
-// clang-format on
 auto hexToRGB(uint32_t x) {
     auto r = (x & 0xff0000) >> 16;
     auto g = (x & 0xff00) >> 8;